@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include "ao.h"
+#include "dag.h"
+#include "raycast.h"
+
+static constexpr size_t AO_CHUNK_SIZE = 256; // Voxels per work item
+static constexpr float AO_RAY_OFFSET = 1e-3f;
+
+uint32_t spread_bits(uint32_t value)
+{
+    value &= 0x3FF;
+    value = (value | (value << 16)) & 0x030000FF;
+    value = (value | (value << 8)) & 0x0300F00F;
+    value = (value | (value << 4)) & 0x030C30C3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
+
+uint32_t face_index(uint32_t axis, bool positive)
+{
+    return 2 * axis + (positive ? 1 : 0);
+}
+
+float AmbientOcclusion::lookup(uint32_t x, uint32_t y, uint32_t z, uint32_t face) const
+{
+    uint32_t key = morton_code(x, y, z);
+    auto it = std::lower_bound(keys.begin(), keys.end(), key);
+    if (it == keys.end() || *it != key)
+        return 1.0f;
+
+    uint32_t value = (faces[it - keys.begin()] >> (face * AO_FACE_BITS)) & AO_FACE_MAX;
+    return static_cast<float>(value) / static_cast<float>(AO_FACE_MAX);
+}
+
+bool AmbientOcclusion::write(const std::string& path) const
+{
+    uint32_t header[3] = {AO_FILE_MAGIC, level_count, static_cast<uint32_t>(keys.size())};
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(faces.data()), faces.size() * sizeof(uint32_t));
+
+    return file.good();
+}
+
+bool AmbientOcclusion::read(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    uint32_t header[3] = {0, 0, 0};
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file.good() || header[0] != AO_FILE_MAGIC)
+        return false;
+    if (header[1] < 2 || header[1] > AO_MAX_LEVELS)
+        return false;
+
+    // Each key is stored with its faces, so the file bounds their count
+    // before anything is allocated
+    auto data_start = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t data_size = static_cast<uint64_t>(file.tellg() - data_start);
+    file.seekg(data_start);
+    if (!file.good() || header[2] != data_size / (2 * sizeof(uint32_t)))
+        return false;
+
+    level_count = header[1];
+    keys.resize(header[2]);
+    faces.resize(header[2]);
+    file.read(reinterpret_cast<char*>(keys.data()), keys.size() * sizeof(uint32_t));
+    file.read(reinterpret_cast<char*>(faces.data()), faces.size() * sizeof(uint32_t));
+
+    return file.good();
+}
+
+// Collects the Morton codes of the surface voxels, in ascending order since
+// children are visited in Morton order. Inside a completely filled node only
+// the voxels on its boundary can be exposed, so the walk skips its interior
+// and the time taken follows the surface rather than the solid volume.
+struct SurfaceWalk {
+    const DAG& dag;
+    const std::vector<std::vector<bool>>& full;
+    std::vector<uint32_t>& output;
+
+    bool is_surface(uint32_t x, uint32_t y, uint32_t z) const
+    {
+        uint32_t root_size = 1 << dag.m_level_count;
+        uint32_t voxel[3] = {x, y, z};
+
+        for (uint32_t face = 0; face < 6; face++) {
+            uint32_t axis = face / 2;
+            bool positive = (face & 1) != 0;
+
+            uint32_t neighbour[3] = {x, y, z};
+            if (positive ? voxel[axis] + 1 >= root_size : voxel[axis] == 0)
+                return true;
+            neighbour[axis] += positive ? 1 : -1;
+
+            if (!dag.get(neighbour[0], neighbour[1], neighbour[2]))
+                return true;
+        }
+        return false;
+    }
+
+    // block is the outermost filled node around this one, with a size of 0
+    // until one is entered
+    void walk(uint32_t level, uint32_t pointer, const uint32_t corner[3], const uint32_t block[3], uint32_t block_size)
+    {
+        uint32_t size = 1 << (dag.m_level_count - level);
+
+        uint32_t entered[3];
+        if (block_size == 0 && full[level][pointer]) {
+            std::copy_n(corner, 3, entered);
+            block = entered;
+            block_size = size;
+        }
+
+        if (block_size != 0) {
+            bool on_boundary = false;
+            for (int i = 0; i < 3; i++)
+                on_boundary = on_boundary || corner[i] == block[i] || corner[i] + size == block[i] + block_size;
+            if (!on_boundary)
+                return;
+        }
+
+        const auto& node = dag.m_levels[level][pointer];
+        uint32_t half = size >> 1;
+
+        for (uint32_t i = 0; i < 8; i++) {
+            if ((node.children & (1 << i)) == 0)
+                continue;
+
+            uint32_t child_corner[3] = {
+                corner[0] + ((i & 1) ? half : 0),
+                corner[1] + ((i & 2) ? half : 0),
+                corner[2] + ((i & 4) ? half : 0),
+            };
+
+            if (level + 2 < dag.m_level_count) {
+                walk(level + 1, node.ptr[i], child_corner, block, block_size);
+                continue;
+            }
+
+            for (uint32_t j = 0; j < 8; j++) {
+                uint32_t x = child_corner[0] + (j & 1);
+                uint32_t y = child_corner[1] + ((j >> 1) & 1);
+                uint32_t z = child_corner[2] + ((j >> 2) & 1);
+                if ((node.ptr[i] & (1 << j)) && is_surface(x, y, z))
+                    output.push_back(morton_code(x, y, z));
+            }
+        }
+    }
+};
+
+uint32_t compact_bits(uint32_t value)
+{
+    value &= 0x09249249;
+    value = (value | (value >> 2)) & 0x030C30C3;
+    value = (value | (value >> 4)) & 0x0300F00F;
+    value = (value | (value >> 8)) & 0x030000FF;
+    value = (value | (value >> 16)) & 0x3FF;
+    return value;
+}
+
+// Van der Corput sequence, the second coordinate of the Hammersley set
+float radical_inverse(uint32_t bits)
+{
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555) << 1) | ((bits & 0xAAAAAAAA) >> 1);
+    bits = ((bits & 0x33333333) << 2) | ((bits & 0xCCCCCCCC) >> 2);
+    bits = ((bits & 0x0F0F0F0F) << 4) | ((bits & 0xF0F0F0F0) >> 4);
+    bits = ((bits & 0x00FF00FF) << 8) | ((bits & 0xFF00FF00) >> 8);
+    return static_cast<float>(bits) * 2.3283064e-10f;
+}
+
+uint32_t bake_face(const DAG& dag, const std::vector<uint32_t>& nodes,
+    const uint32_t voxel[3], uint32_t axis, bool positive, uint32_t key,
+    uint32_t ray_count, float max_distance)
+{
+    float center[3] = {voxel[0] + 0.5f, voxel[1] + 0.5f, voxel[2] + 0.5f};
+    float sign = positive ? 1.0f : -1.0f;
+    center[axis] += sign * (0.5f + AO_RAY_OFFSET);
+
+    // Rotate the sample pattern per voxel so that neighbouring faces don't
+    // share their error
+    float rotation = static_cast<float>((key * 2654435761u) >> 8) / static_cast<float>(1 << 24);
+
+    uint32_t tangent = (axis + 1) % 3;
+    uint32_t bitangent = (axis + 2) % 3;
+
+    uint32_t open = 0;
+    for (uint32_t i = 0; i < ray_count; i++) {
+        float u = (static_cast<float>(i) + 0.5f) / static_cast<float>(ray_count);
+        float phi = 2.0f * 3.1415926f * (radical_inverse(i) + rotation);
+        float r = std::sqrt(u);
+
+        float d[3];
+        d[tangent] = r * std::cos(phi);
+        d[bitangent] = r * std::sin(phi);
+        d[axis] = sign * std::sqrt(std::max(1.0f - u, 0.0f));
+
+        RayHit hit = raycast(nodes, dag.m_level_count, Vec3(center[0], center[1], center[2]), Vec3(d[0], d[1], d[2]));
+        if (!hit.hit || hit.distance > max_distance)
+            open++;
+    }
+
+    return (open * AO_FACE_MAX + ray_count / 2) / ray_count;
+}
+
+AmbientOcclusion bake_ambient_occlusion(const DAG& dag, uint32_t ray_count, float max_distance, unsigned thread_count)
+{
+    AmbientOcclusion result;
+    result.level_count = dag.m_level_count;
+    if (dag.m_level_count < 2 || dag.m_level_count > AO_MAX_LEVELS)
+        return result;
+
+    auto full = find_full_nodes(dag);
+    uint32_t corner[3] = {0, 0, 0};
+    SurfaceWalk surface_walk{dag, full, result.keys};
+    surface_walk.walk(0, 0, corner, corner, 0);
+
+    // All AO_FACE_MAX bits for faces against solid neighbours
+    result.faces.resize(result.keys.size());
+    auto nodes = dag.flatten();
+    uint32_t root_size = 1 << dag.m_level_count;
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::atomic<size_t> next_chunk = 0;
+    auto worker = [&] {
+        while (true) {
+            size_t first = next_chunk.fetch_add(AO_CHUNK_SIZE);
+            if (first >= result.keys.size())
+                return;
+
+            size_t last = std::min(first + AO_CHUNK_SIZE, result.keys.size());
+            for (size_t i = first; i < last; i++) {
+                uint32_t key = result.keys[i];
+                uint32_t voxel[3] = {compact_bits(key), compact_bits(key >> 1), compact_bits(key >> 2)};
+
+                uint32_t packed = 0;
+                for (uint32_t face = 0; face < 6; face++) {
+                    uint32_t axis = face / 2;
+                    bool positive = (face & 1) != 0;
+
+                    uint32_t neighbour[3] = {voxel[0], voxel[1], voxel[2]};
+                    bool outside = positive ? neighbour[axis] + 1 >= root_size : neighbour[axis] == 0;
+                    neighbour[axis] += positive ? 1 : -1;
+
+                    uint32_t value = AO_FACE_MAX;
+                    if (outside || !dag.get(neighbour[0], neighbour[1], neighbour[2]))
+                        value = bake_face(dag, nodes, voxel, axis, positive, key, ray_count, max_distance);
+
+                    packed |= value << (face * AO_FACE_BITS);
+                }
+
+                result.faces[i] = packed;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    return result;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class DAG;
+
+static constexpr uint32_t AO_FILE_MAGIC = 0x4F415653; // "SVAO"
+static constexpr uint32_t AO_MAX_LEVELS = 10; // Morton codes must fit in 32 bits
+static constexpr uint32_t AO_FACE_BITS = 5;
+static constexpr uint32_t AO_FACE_MAX = (1 << AO_FACE_BITS) - 1;
+static constexpr uint32_t AO_RAY_COUNT = 64;
+static constexpr float AO_MAX_DISTANCE = 16.0f; // In voxels
+
+// Ambient occlusion of the faces of every surface voxel, that is every solid
+// voxel with an empty neighbour. Voxels are stored in Morton order, each with
+// AO_FACE_BITS of visibility per face, in the order -x, +x, -y, +y, -z, +z.
+struct AmbientOcclusion {
+    uint32_t level_count = 0;
+    std::vector<uint32_t> keys; // Morton codes, ascending
+    std::vector<uint32_t> faces;
+
+    // Fraction of the hemisphere above the face that is open, 1 for voxels
+    // that were not baked
+    float lookup(uint32_t x, uint32_t y, uint32_t z, uint32_t face) const;
+
+    bool write(const std::string& path) const;
+    bool read(const std::string& path);
+};
+
+uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z);
+
+// Face index of an axis aligned normal as returned by raycast()
+uint32_t face_index(uint32_t axis, bool positive);
+
+// Traces ray_count cosine distributed rays from every exposed face, spread over
+// thread_count threads. Rays hitting within max_distance count as occluded.
+AmbientOcclusion bake_ambient_occlusion(const DAG& dag, uint32_t ray_count = AO_RAY_COUNT,
+    float max_distance = AO_MAX_DISTANCE, unsigned thread_count = 0);
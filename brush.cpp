@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+#include "brush.h"
+#include "dag.h"
+
+// Nodes created while editing an octant are referenced with this bit set until
+// they are merged into the DAG
+static constexpr uint32_t STAGED_BIT = 0x80000000;
+static constexpr uint32_t NO_NODE = 0xFFFFFFFF;
+
+bool overlaps(const uint32_t min[3], const uint32_t max[3], const uint32_t corner[3], uint32_t size)
+{
+    for (int i = 0; i < 3; i++) {
+        if (corner[i] + size <= min[i] || corner[i] >= max[i])
+            return false;
+    }
+    return true;
+}
+
+SphereBrush::SphereBrush(float x, float y, float z, float radius)
+    : center{x, y, z}
+    , radius_squared(radius * radius)
+{
+}
+
+BrushCoverage SphereBrush::classify(const uint32_t corner[3], uint32_t size) const
+{
+    // Squared distances to the nearest and farthest voxel centers of the cube.
+    // The farthest one is a voxel center like the ones contains() tests, so the
+    // cube is inside exactly when all of its voxels are.
+    float nearest = 0.0f;
+    float farthest = 0.0f;
+    for (int i = 0; i < 3; i++) {
+        float low = static_cast<float>(corner[i]) + 0.5f - center[i];
+        float high = static_cast<float>(corner[i] + size) - 0.5f - center[i];
+        float near = low > 0.0f ? low : high < 0.0f ? high : 0.0f;
+        float far = std::max(std::abs(low), std::abs(high));
+        nearest += near * near;
+        farthest += far * far;
+    }
+
+    if (nearest > radius_squared)
+        return BrushCoverage::Outside;
+    if (farthest <= radius_squared)
+        return BrushCoverage::Inside;
+    return BrushCoverage::Partial;
+}
+
+bool SphereBrush::contains(uint32_t x, uint32_t y, uint32_t z) const
+{
+    float d[3] = {
+        static_cast<float>(x) + 0.5f - center[0],
+        static_cast<float>(y) + 0.5f - center[1],
+        static_cast<float>(z) + 0.5f - center[2],
+    };
+    return d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= radius_squared;
+}
+
+BoxBrush::BoxBrush(const uint32_t min[3], const uint32_t max[3])
+{
+    std::copy_n(min, 3, this->min);
+    std::copy_n(max, 3, this->max);
+}
+
+BrushCoverage BoxBrush::classify(const uint32_t corner[3], uint32_t size) const
+{
+    if (!overlaps(min, max, corner, size))
+        return BrushCoverage::Outside;
+
+    for (int i = 0; i < 3; i++) {
+        if (corner[i] < min[i] || corner[i] + size > max[i])
+            return BrushCoverage::Partial;
+    }
+    return BrushCoverage::Inside;
+}
+
+bool BoxBrush::contains(uint32_t x, uint32_t y, uint32_t z) const
+{
+    return x >= min[0] && y >= min[1] && z >= min[2] && x < max[0] && y < max[1] && z < max[2];
+}
+
+MaskBrush::MaskBrush(const uint32_t origin[3], const uint32_t size[3], std::vector<bool> voxels)
+    : voxels(std::move(voxels))
+{
+    std::copy_n(origin, 3, this->origin);
+    std::copy_n(size, 3, this->size);
+}
+
+BrushCoverage MaskBrush::classify(const uint32_t corner[3], uint32_t size) const
+{
+    uint32_t max[3] = {origin[0] + this->size[0], origin[1] + this->size[1], origin[2] + this->size[2]};
+    return overlaps(origin, max, corner, size) ? BrushCoverage::Partial : BrushCoverage::Outside;
+}
+
+bool MaskBrush::contains(uint32_t x, uint32_t y, uint32_t z) const
+{
+    if (x < origin[0] || y < origin[1] || z < origin[2])
+        return false;
+
+    x -= origin[0];
+    y -= origin[1];
+    z -= origin[2];
+    if (x >= size[0] || y >= size[1] || z >= size[2])
+        return false;
+
+    return voxels[(static_cast<size_t>(z) * size[1] + y) * size[0] + x];
+}
+
+// Edits the subtree of one octant of the root. The DAG is only read, so that
+// octants can be edited in parallel, and new nodes are staged until merge().
+// Pointers at level L-1 are leaf masks, as in DAGNode::ptr.
+class OctantEdit {
+public:
+    OctantEdit(const DAG& dag, const Brush& brush, BrushOp op);
+
+    uint32_t edit(uint32_t level, uint32_t pointer, const uint32_t corner[3]);
+    // Adds the staged nodes to the DAG and returns where the given pointer,
+    // one level below the root, ended up
+    uint32_t merge(DAG& dag, uint32_t pointer) const;
+
+private:
+    const DAGNode& get_node(uint32_t level, uint32_t pointer) const;
+    bool is_empty(uint32_t level, uint32_t pointer) const;
+    uint32_t uniform(uint32_t level);
+    uint32_t stage(uint32_t level, const DAGNode& node);
+
+    const DAG& dag;
+    const Brush& brush;
+    BrushOp op;
+
+    std::vector<std::vector<DAGNode>> levels;
+    std::vector<std::unordered_map<DAGNode, uint32_t, DAGNodeHash>> index;
+    // Completely filled or empty node of each level, depending on op
+    std::vector<uint32_t> uniforms;
+};
+
+OctantEdit::OctantEdit(const DAG& dag, const Brush& brush, BrushOp op)
+    : dag(dag)
+    , brush(brush)
+    , op(op)
+    , levels(dag.m_level_count)
+    , index(dag.m_level_count)
+    , uniforms(dag.m_level_count, NO_NODE)
+{
+}
+
+uint32_t OctantEdit::edit(uint32_t level, uint32_t pointer, const uint32_t corner[3])
+{
+    uint32_t size = 1 << (dag.m_level_count - level);
+
+    auto coverage = brush.classify(corner, size);
+    if (coverage == BrushCoverage::Outside)
+        return pointer;
+    if (coverage == BrushCoverage::Inside)
+        return uniform(level);
+
+    uint32_t half = size >> 1;
+
+    if (level == dag.m_level_count - 1) {
+        uint32_t mask = pointer;
+        for (uint32_t i = 0; i < 8; i++) {
+            if (!brush.contains(corner[0] + (i & 1), corner[1] + ((i >> 1) & 1), corner[2] + ((i >> 2) & 1)))
+                continue;
+
+            if (op == BrushOp::Union)
+                mask |= 1 << i;
+            else
+                mask &= ~(1 << i);
+        }
+        return mask;
+    }
+
+    DAGNode node = get_node(level, pointer);
+    DAGNode original = node;
+
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t child_corner[3] = {
+            corner[0] + ((i & 1) ? half : 0),
+            corner[1] + ((i & 2) ? half : 0),
+            corner[2] + ((i & 4) ? half : 0),
+        };
+        node.ptr[i] = edit(level + 1, node.ptr[i], child_corner);
+
+        if (is_empty(level + 1, node.ptr[i]))
+            node.children &= ~(1 << i);
+        else
+            node.children |= 1 << i;
+    }
+
+    if (node == original)
+        return pointer;
+
+    return stage(level, node);
+}
+
+uint32_t OctantEdit::merge(DAG& dag, uint32_t pointer) const
+{
+    // Bottom up, so that staged children are in the DAG before their parents
+    std::vector<std::vector<uint32_t>> remap(levels.size());
+    for (uint32_t level = dag.m_level_count - 1; level-- > 1;) {
+        bool is_last = level + 2 >= dag.m_level_count;
+
+        for (DAGNode node : levels[level]) {
+            for (auto& ptr : node.ptr) {
+                if (!is_last && (ptr & STAGED_BIT))
+                    ptr = remap[level + 1][ptr & ~STAGED_BIT];
+            }
+            remap[level].push_back(dag.find_or_insert(level, node));
+        }
+    }
+
+    return (pointer & STAGED_BIT) ? remap[1][pointer & ~STAGED_BIT] : pointer;
+}
+
+const DAGNode& OctantEdit::get_node(uint32_t level, uint32_t pointer) const
+{
+    if (pointer & STAGED_BIT)
+        return levels[level][pointer & ~STAGED_BIT];
+
+    return dag.m_levels[level][pointer];
+}
+
+bool OctantEdit::is_empty(uint32_t level, uint32_t pointer) const
+{
+    if (level == dag.m_level_count - 1)
+        return pointer == 0;
+
+    return get_node(level, pointer).children == 0;
+}
+
+uint32_t OctantEdit::uniform(uint32_t level)
+{
+    bool full = op == BrushOp::Union;
+    if (level == dag.m_level_count - 1)
+        return full ? 0xFF : 0;
+
+    if (uniforms[level] == NO_NODE) {
+        DAGNode node(full ? 0xFF : 0);
+        std::fill_n(node.ptr, 8, uniform(level + 1));
+        uniforms[level] = stage(level, node);
+    }
+
+    return uniforms[level];
+}
+
+uint32_t OctantEdit::stage(uint32_t level, const DAGNode& node)
+{
+    auto existing = dag.m_index[level].find(node);
+    if (existing != dag.m_index[level].end())
+        return existing->second;
+
+    auto [it, inserted] = index[level].emplace(node, STAGED_BIT | static_cast<uint32_t>(levels[level].size()));
+    if (inserted)
+        levels[level].push_back(node);
+
+    return it->second;
+}
+
+void apply_brush(DAG& dag, const Brush& brush, BrushOp op, unsigned thread_count)
+{
+    uint32_t level_count = dag.m_level_count;
+    uint32_t root_corner[3] = {0, 0, 0};
+    if (level_count < 2 || brush.classify(root_corner, 1 << level_count) == BrushCoverage::Outside)
+        return;
+
+    dag.build_index();
+
+    const DAGNode root = dag.m_levels[0][0];
+    uint32_t half = 1 << (level_count - 1);
+
+    std::vector<OctantEdit> edits;
+    edits.reserve(8);
+    for (uint32_t i = 0; i < 8; i++)
+        edits.emplace_back(dag, brush, op);
+
+    uint32_t results[8];
+    std::atomic<uint32_t> next_octant = 0;
+    auto worker = [&] {
+        uint32_t i;
+        while ((i = next_octant.fetch_add(1)) < 8) {
+            uint32_t corner[3] = {(i & 1) ? half : 0, (i & 2) ? half : 0, (i & 4) ? half : 0};
+            results[i] = edits[i].edit(1, root.ptr[i], corner);
+        }
+    };
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min(thread_count, 8u); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    // Merged in octant order, which keeps node indices independent of timing
+    DAGNode node = root;
+    for (uint32_t i = 0; i < 8; i++) {
+        node.ptr[i] = edits[i].merge(dag, results[i]);
+
+        bool empty = level_count == 2 ? node.ptr[i] == 0 : dag.m_levels[1][node.ptr[i]].children == 0;
+        if (empty)
+            node.children &= ~(1 << i);
+        else
+            node.children |= 1 << i;
+    }
+
+    dag.set_root(node);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class DAG;
+
+enum class BrushOp {
+    Union,
+    Subtract,
+};
+
+enum class BrushCoverage {
+    Outside,
+    Partial,
+    Inside,
+};
+
+// A shape in voxel space. Edits fill or skip every cube that classify() puts
+// entirely inside or outside, and only visit the voxels of partial ones, so
+// Partial is always a correct if slow answer.
+class Brush {
+public:
+    virtual ~Brush() = default;
+
+    // Whether all, some or none of the voxels of the cube with the given
+    // corner and edge length are inside
+    virtual BrushCoverage classify(const uint32_t corner[3], uint32_t size) const = 0;
+    virtual bool contains(uint32_t x, uint32_t y, uint32_t z) const = 0;
+};
+
+// Voxels whose centers are within radius of center
+class SphereBrush : public Brush {
+public:
+    SphereBrush(float x, float y, float z, float radius);
+
+    BrushCoverage classify(const uint32_t corner[3], uint32_t size) const override;
+    bool contains(uint32_t x, uint32_t y, uint32_t z) const override;
+
+private:
+    float center[3];
+    float radius_squared;
+};
+
+// Voxels from min up to but not including max
+class BoxBrush : public Brush {
+public:
+    BoxBrush(const uint32_t min[3], const uint32_t max[3]);
+
+    BrushCoverage classify(const uint32_t corner[3], uint32_t size) const override;
+    bool contains(uint32_t x, uint32_t y, uint32_t z) const override;
+
+private:
+    uint32_t min[3];
+    uint32_t max[3];
+};
+
+// A dense block of voxels with its lowest corner at origin, x varying fastest
+class MaskBrush : public Brush {
+public:
+    MaskBrush(const uint32_t origin[3], const uint32_t size[3], std::vector<bool> voxels);
+
+    BrushCoverage classify(const uint32_t corner[3], uint32_t size) const override;
+    bool contains(uint32_t x, uint32_t y, uint32_t z) const override;
+
+private:
+    uint32_t origin[3];
+    uint32_t size[3];
+    std::vector<bool> voxels;
+};
+
+// Adds or removes the voxels of the brush. Each of the 8 octants of the root
+// is edited by one of thread_count threads, 0 for one per core, and the result
+// does not depend on the thread count.
+void apply_brush(DAG& dag, const Brush& brush, BrushOp op, unsigned thread_count = 0);
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include "builder.h"
+#include "node-index.h"
+
+// Subtrees with at most this edge length in voxels are built by a single task
+static constexpr uint32_t TASK_SIZE = 16;
+
+// A node whose children are built by other tasks
+struct PendingNode {
+    DAGNode node;
+    std::atomic<uint32_t> remaining = 8;
+    uint32_t level;
+    PendingNode* parent;
+    uint32_t octant;
+};
+
+struct BuildTask {
+    uint32_t level;
+    uint32_t corner[3];
+    PendingNode* parent;
+    uint32_t octant;
+};
+
+class Builder {
+public:
+    Builder(const Map& map, uint32_t level_count, unsigned thread_count);
+
+    void run(unsigned thread);
+    const DAGNode& get_root() const { return root; }
+    const NodeIndex& get_index() const { return index; }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<BuildTask> tasks;
+    };
+
+    bool pop(unsigned thread, BuildTask& task);
+    void push(unsigned thread, const BuildTask& task);
+    void execute(unsigned thread, const BuildTask& task);
+    uint32_t build(uint32_t level, const uint32_t corner[3]);
+    void complete(PendingNode* parent, uint32_t octant, uint32_t level, uint32_t pointer);
+    bool is_empty(uint32_t level, uint32_t pointer) const;
+
+    const Map& map;
+    uint32_t level_count;
+    NodeIndex index;
+    std::vector<Worker> workers;
+
+    DAGNode root;
+    std::atomic<bool> done = false;
+};
+
+Builder::Builder(const Map& map, uint32_t level_count, unsigned thread_count)
+    : map(map)
+    , level_count(level_count)
+    , index(level_count)
+    , workers(thread_count)
+{
+    // The root task, whose parent is the root itself
+    auto* pending = new PendingNode;
+    pending->level = 0;
+    pending->parent = nullptr;
+    pending->octant = 0;
+
+    uint32_t half = 1 << (level_count - 1);
+    for (uint32_t i = 0; i < 8; i++) {
+        BuildTask task{1, {(i & 1) ? half : 0, (i & 2) ? half : 0, (i & 4) ? half : 0}, pending, i};
+        workers[i % thread_count].tasks.push_back(task);
+    }
+}
+
+void Builder::run(unsigned thread)
+{
+    BuildTask task;
+    while (!done.load()) {
+        if (pop(thread, task))
+            execute(thread, task);
+        else
+            std::this_thread::yield();
+    }
+}
+
+bool Builder::pop(unsigned thread, BuildTask& task)
+{
+    // The newest task of this thread, which is the smallest and shares the
+    // most with what it just built
+    {
+        auto& worker = workers[thread];
+        std::lock_guard lock(worker.mutex);
+        if (!worker.tasks.empty()) {
+            task = worker.tasks.back();
+            worker.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers.size(); i++) {
+        auto& victim = workers[(thread + i) % workers.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Builder::push(unsigned thread, const BuildTask& task)
+{
+    auto& worker = workers[thread];
+    std::lock_guard lock(worker.mutex);
+    worker.tasks.push_back(task);
+}
+
+void Builder::execute(unsigned thread, const BuildTask& task)
+{
+    uint32_t size = 1 << (level_count - task.level);
+    if (size <= TASK_SIZE || task.level + 1 >= level_count) {
+        complete(task.parent, task.octant, task.level, build(task.level, task.corner));
+        return;
+    }
+
+    auto* pending = new PendingNode;
+    pending->level = task.level;
+    pending->parent = task.parent;
+    pending->octant = task.octant;
+
+    uint32_t half = size >> 1;
+    for (uint32_t i = 0; i < 8; i++) {
+        BuildTask child{task.level + 1,
+            {
+                task.corner[0] + ((i & 1) ? half : 0),
+                task.corner[1] + ((i & 2) ? half : 0),
+                task.corner[2] + ((i & 4) ? half : 0),
+            },
+            pending, i};
+        push(thread, child);
+    }
+}
+
+uint32_t Builder::build(uint32_t level, const uint32_t corner[3])
+{
+    if (level == level_count - 1)
+        return make_leaf(map, corner[0], corner[1], corner[2]);
+
+    uint32_t half = 1 << (level_count - level - 1);
+    DAGNode node;
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t child_corner[3] = {
+            corner[0] + ((i & 1) ? half : 0),
+            corner[1] + ((i & 2) ? half : 0),
+            corner[2] + ((i & 4) ? half : 0),
+        };
+        node.ptr[i] = build(level + 1, child_corner);
+        if (!is_empty(level + 1, node.ptr[i]))
+            node.children |= 1 << i;
+    }
+
+    return index.find_or_insert(level, node);
+}
+
+void Builder::complete(PendingNode* parent, uint32_t octant, uint32_t level, uint32_t pointer)
+{
+    // Each child writes its own pointer, and the counter orders these writes
+    // before the last child reads the node
+    parent->node.ptr[octant] = pointer;
+    if (parent->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    for (uint32_t i = 0; i < 8; i++) {
+        if (!is_empty(level, parent->node.ptr[i]))
+            parent->node.children |= 1 << i;
+    }
+
+    if (parent->level == 0) {
+        root = parent->node;
+        delete parent;
+        done.store(true);
+        return;
+    }
+
+    uint32_t result = index.find_or_insert(parent->level, parent->node);
+    PendingNode* grandparent = parent->parent;
+    uint32_t parent_octant = parent->octant;
+    uint32_t parent_level = parent->level;
+    delete parent;
+
+    complete(grandparent, parent_octant, parent_level, result);
+}
+
+bool Builder::is_empty(uint32_t level, uint32_t pointer) const
+{
+    if (level == level_count - 1)
+        return pointer == 0;
+
+    return index.node(level, pointer).children == 0;
+}
+
+enum class Dirtiness {
+    Clean,
+    Partial,
+    Dirty,
+};
+
+Dirtiness classify(const std::vector<DirtyBox>& dirty, const uint32_t corner[3], uint32_t size)
+{
+    auto result = Dirtiness::Clean;
+    for (const auto& box : dirty) {
+        bool overlaps = true;
+        bool inside = true;
+        for (int i = 0; i < 3; i++) {
+            overlaps = overlaps && corner[i] + size > box.min[i] && corner[i] < box.max[i];
+            inside = inside && corner[i] >= box.min[i] && corner[i] + size <= box.max[i];
+        }
+
+        if (inside)
+            return Dirtiness::Dirty;
+        if (overlaps)
+            result = Dirtiness::Partial;
+    }
+
+    return result;
+}
+
+uint32_t resample(DAG& dag, const Map& map, uint32_t level, const uint32_t corner[3])
+{
+    if (level == dag.m_level_count - 1)
+        return make_leaf(map, corner[0], corner[1], corner[2]);
+
+    uint32_t half = 1 << (dag.m_level_count - level - 1);
+    bool is_last = level + 2 >= dag.m_level_count;
+
+    DAGNode node;
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t child_corner[3] = {
+            corner[0] + ((i & 1) ? half : 0),
+            corner[1] + ((i & 2) ? half : 0),
+            corner[2] + ((i & 4) ? half : 0),
+        };
+        node.ptr[i] = resample(dag, map, level + 1, child_corner);
+
+        bool empty = is_last ? node.ptr[i] == 0 : dag.m_levels[level + 1][node.ptr[i]].children == 0;
+        if (!empty)
+            node.children |= 1 << i;
+    }
+
+    return dag.find_or_insert(level, node);
+}
+
+// Returns the rebuilt node, or the leaf mask at level L-1
+uint32_t rebuild_node(DAG& dag, const Map& map, const std::vector<DirtyBox>& dirty, uint32_t level,
+    uint32_t pointer, const uint32_t corner[3])
+{
+    uint32_t size = 1 << (dag.m_level_count - level);
+
+    auto dirtiness = classify(dirty, corner, size);
+    if (dirtiness == Dirtiness::Clean)
+        return pointer;
+    if (dirtiness == Dirtiness::Dirty)
+        return resample(dag, map, level, corner);
+
+    if (level == dag.m_level_count - 1) {
+        uint32_t mask = pointer;
+        for (uint32_t i = 0; i < 8; i++) {
+            uint32_t voxel[3] = {corner[0] + (i & 1), corner[1] + ((i >> 1) & 1), corner[2] + ((i >> 2) & 1)};
+            if (classify(dirty, voxel, 1) == Dirtiness::Clean)
+                continue;
+
+            if (map.get(voxel[0], voxel[1], voxel[2]))
+                mask |= 1 << i;
+            else
+                mask &= ~(1 << i);
+        }
+        return mask;
+    }
+
+    uint32_t half = size >> 1;
+    bool is_last = level + 2 >= dag.m_level_count;
+
+    // Copied, since inserting children may reallocate the level
+    DAGNode node = dag.m_levels[level][pointer];
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t child_corner[3] = {
+            corner[0] + ((i & 1) ? half : 0),
+            corner[1] + ((i & 2) ? half : 0),
+            corner[2] + ((i & 4) ? half : 0),
+        };
+        node.ptr[i] = rebuild_node(dag, map, dirty, level + 1, node.ptr[i], child_corner);
+
+        bool empty = is_last ? node.ptr[i] == 0 : dag.m_levels[level + 1][node.ptr[i]].children == 0;
+        if (empty)
+            node.children &= ~(1 << i);
+        else
+            node.children |= 1 << i;
+    }
+
+    return dag.find_or_insert(level, node);
+}
+
+void rebuild(DAG& dag, const Map& map, const std::vector<DirtyBox>& dirty)
+{
+    uint32_t corner[3] = {0, 0, 0};
+    if (dag.m_level_count < 2 || classify(dirty, corner, 1 << dag.m_level_count) == Dirtiness::Clean)
+        return;
+
+    // The root level holds versions too, so the root is never replaced by
+    // find_or_insert()
+    uint32_t half = 1 << (dag.m_level_count - 1);
+    DAGNode root = dag.m_levels[0][0];
+    for (uint32_t i = 0; i < 8; i++) {
+        uint32_t child_corner[3] = {(i & 1) ? half : 0, (i & 2) ? half : 0, (i & 4) ? half : 0};
+        root.ptr[i] = rebuild_node(dag, map, dirty, 1, root.ptr[i], child_corner);
+
+        bool empty = dag.m_level_count == 2 ? root.ptr[i] == 0 : dag.m_levels[1][root.ptr[i]].children == 0;
+        if (empty)
+            root.children &= ~(1 << i);
+        else
+            root.children |= 1 << i;
+    }
+
+    dag.set_root(root);
+}
+
+DAG build_dag(const Map& map, uint32_t levels, unsigned thread_count)
+{
+    if (levels < 2)
+        return DAG(map, levels);
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    Builder builder(map, levels, thread_count);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < thread_count; i++)
+        threads.emplace_back(&Builder::run, &builder, i);
+    builder.run(0);
+    for (auto& thread : threads)
+        thread.join();
+
+    // Filled in directly, as build_svdag() fills the levels of DAG(map, levels).
+    // Nodes are renumbered bottom up in sorted order, as build_svdag() leaves
+    // them, so that the result does not depend on which thread inserted first.
+    DAG dag(0);
+    dag.m_level_count = levels;
+    dag.m_levels.resize(levels);
+
+    const auto& index = builder.get_index();
+    std::vector<uint32_t> renumbered;
+    for (uint32_t level = levels - 1; level-- > 1;) {
+        bool is_last = level + 2 >= levels;
+
+        std::vector<DAGNode> nodes(index.size(level));
+        for (uint32_t i = 0; i < nodes.size(); i++) {
+            nodes[i] = index.node(level, i);
+            if (!is_last) {
+                for (auto& ptr : nodes[i].ptr)
+                    ptr = renumbered[ptr];
+            }
+        }
+
+        std::vector<uint32_t> order(nodes.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+            return nodes[lhs] < nodes[rhs];
+        });
+
+        renumbered.assign(nodes.size(), 0);
+        dag.m_levels[level].reserve(nodes.size());
+        for (uint32_t i = 0; i < order.size(); i++) {
+            renumbered[order[i]] = i;
+            dag.m_levels[level].push_back(nodes[order[i]]);
+        }
+    }
+
+    DAGNode root = builder.get_root();
+    if (levels > 2) {
+        for (auto& ptr : root.ptr)
+            ptr = renumbered[ptr];
+    }
+    dag.m_levels[0].push_back(root);
+
+    return dag;
+}
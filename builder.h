@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "dag.h"
+
+// Voxels from min up to but not including max
+struct DirtyBox {
+    uint32_t min[3];
+    uint32_t max[3];
+};
+
+// Builds the same volume as DAG(map, levels) top down. Every task builds one
+// subtree: large ones are split into 8 child tasks, and once the children are
+// done the last of them finishes the parent, while small ones are built to
+// completion bottom up by the thread that runs them. Idle threads steal the
+// oldest, and so largest, tasks of the others, and all of them deduplicate
+// through one NodeIndex. The nodes end up in the same order as with
+// DAG(map, levels), whatever the thread count. Runs on thread_count threads,
+// 0 for one per core.
+DAG build_dag(const Map& map, uint32_t levels, unsigned thread_count = 0);
+
+// Brings the voxels inside the boxes up to date with the map, leaving the
+// others as they are. Subtrees entirely inside a box are sampled anew, those
+// that partly overlap one are descended into, and all others are kept, so the
+// time taken follows the dirty volume. New nodes are shared with equal
+// existing ones through find_or_insert() and the root is replaced in place.
+void rebuild(DAG& dag, const Map& map, const std::vector<DirtyBox>& dirty);
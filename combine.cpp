@@ -0,0 +1,178 @@
+#include <unordered_map>
+#include "combine.h"
+#include "diff.h"
+
+class Combiner {
+public:
+    Combiner(const DAG& a, const DAG& b, SetOp op, DAG& output);
+
+    // Returns the combined node in the output, at level L-1 a leaf mask
+    uint32_t combine(uint32_t level, uint32_t x, uint32_t y);
+
+private:
+    bool is_empty(const DAG& dag, uint32_t level, uint32_t pointer) const;
+    uint32_t full(uint32_t level);
+    uint32_t copy(int side, uint32_t level, uint32_t pointer);
+
+    const DAG& a;
+    const DAG& b;
+    SetOp op;
+    DAG& output;
+    uint32_t level_count;
+
+    // Nodes of b equal to nodes of a, empty when both are the same DAG
+    std::vector<std::vector<uint32_t>> translated;
+    std::vector<std::vector<bool>> full_nodes[2];
+
+    std::vector<std::unordered_map<uint64_t, uint32_t>> combined;
+    std::vector<std::unordered_map<uint32_t, uint32_t>> copied[2];
+    std::vector<uint32_t> full_node;
+};
+
+static constexpr uint32_t NO_NODE = 0xFFFFFFFF;
+
+Combiner::Combiner(const DAG& a, const DAG& b, SetOp op, DAG& output)
+    : a(a)
+    , b(b)
+    , op(op)
+    , output(output)
+    , level_count(a.m_level_count)
+    , combined(a.m_level_count)
+    , full_node(a.m_level_count, NO_NODE)
+{
+    if (&a != &b)
+        translated = translate_nodes(a, b);
+
+    full_nodes[0] = find_full_nodes(a);
+    full_nodes[1] = &a == &b ? full_nodes[0] : find_full_nodes(b);
+    copied[0].resize(level_count);
+    copied[1].resize(level_count);
+}
+
+uint32_t Combiner::combine(uint32_t level, uint32_t x, uint32_t y)
+{
+    if (level == level_count - 1) {
+        switch (op) {
+        case SetOp::Union:
+            return x | y;
+        case SetOp::Intersection:
+            return x & y;
+        case SetOp::Difference:
+            return x & ~y;
+        }
+    }
+
+    bool empty_x = is_empty(a, level, x);
+    bool empty_y = is_empty(b, level, y);
+    bool full_x = full_nodes[0][level][x];
+    bool full_y = full_nodes[1][level][y];
+    bool same = (translated.empty() ? y : translated[level][y]) == x;
+
+    // The output has its empty node at 0
+    switch (op) {
+    case SetOp::Union:
+        if (full_x || full_y)
+            return full(level);
+        if (empty_y || same)
+            return copy(0, level, x);
+        if (empty_x)
+            return copy(1, level, y);
+        break;
+    case SetOp::Intersection:
+        if (empty_x || empty_y)
+            return 0;
+        if (full_y || same)
+            return copy(0, level, x);
+        if (full_x)
+            return copy(1, level, y);
+        break;
+    case SetOp::Difference:
+        if (empty_x || full_y || same)
+            return 0;
+        if (empty_y)
+            return copy(0, level, x);
+        break;
+    }
+
+    uint64_t key = (static_cast<uint64_t>(x) << 32) | y;
+    auto it = combined[level].find(key);
+    if (it != combined[level].end())
+        return it->second;
+
+    const auto& node_x = a.m_levels[level][x];
+    const auto& node_y = b.m_levels[level][y];
+
+    DAGNode node;
+    for (uint32_t i = 0; i < 8; i++) {
+        node.ptr[i] = combine(level + 1, node_x.ptr[i], node_y.ptr[i]);
+        if (!is_empty(output, level + 1, node.ptr[i]))
+            node.children |= 1 << i;
+    }
+
+    uint32_t result = output.find_or_insert(level, node);
+    combined[level].emplace(key, result);
+    return result;
+}
+
+bool Combiner::is_empty(const DAG& dag, uint32_t level, uint32_t pointer) const
+{
+    if (level == level_count - 1)
+        return pointer == 0;
+
+    return dag.m_levels[level][pointer].children == 0;
+}
+
+uint32_t Combiner::full(uint32_t level)
+{
+    if (level == level_count - 1)
+        return 0xFF;
+
+    if (full_node[level] == NO_NODE) {
+        DAGNode node(0xFF);
+        std::fill_n(node.ptr, 8, full(level + 1));
+        full_node[level] = output.find_or_insert(level, node);
+    }
+
+    return full_node[level];
+}
+
+uint32_t Combiner::copy(int side, uint32_t level, uint32_t pointer)
+{
+    if (level == level_count - 1)
+        return pointer;
+
+    auto it = copied[side][level].find(pointer);
+    if (it != copied[side][level].end())
+        return it->second;
+
+    DAGNode node = (side == 0 ? a : b).m_levels[level][pointer];
+    for (auto& ptr : node.ptr)
+        ptr = copy(side, level + 1, ptr);
+
+    uint32_t result = output.find_or_insert(level, node);
+    copied[side][level].emplace(pointer, result);
+    return result;
+}
+
+DAG combine(const DAG& a, const DAG& b, SetOp op)
+{
+    DAG output(a.m_level_count);
+    if (a.m_level_count < 2 || b.m_level_count != a.m_level_count)
+        return output;
+
+    Combiner combiner(a, b, op, output);
+    const auto& root_a = a.m_levels[0][0];
+    const auto& root_b = b.m_levels[0][0];
+
+    DAGNode root;
+    for (uint32_t i = 0; i < 8; i++) {
+        root.ptr[i] = combiner.combine(1, root_a.ptr[i], root_b.ptr[i]);
+
+        bool empty = a.m_level_count == 2 ? root.ptr[i] == 0 : output.m_levels[1][root.ptr[i]].children == 0;
+        if (!empty)
+            root.children |= 1 << i;
+    }
+    output.set_root(root);
+
+    return output;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include "dag.h"
+
+enum class SetOp {
+    Union,
+    Intersection,
+    Difference,
+};
+
+// Combines the working roots of two DAGs with the same level count into a new
+// DAG. Both trees are walked together, memoized on pairs of nodes, and pairs
+// with an empty, full or equal side are resolved without descending, so the
+// work follows the number of distinct node pairs rather than the volume.
+DAG combine(const DAG& a, const DAG& b, SetOp op);
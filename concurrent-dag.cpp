@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include "concurrent-dag.h"
+
+NodeArena::NodeArena()
+    : blocks(MAX_BLOCKS)
+{
+}
+
+uint32_t NodeArena::push_back(const DAGNode& node)
+{
+    if (count == MAX_BLOCKS * BLOCK_SIZE) {
+        std::cerr << "node arena is full" << std::endl;
+        std::abort();
+    }
+
+    if ((count & (BLOCK_SIZE - 1)) == 0)
+        blocks[count >> BLOCK_BITS] = std::make_unique<DAGNode[]>(BLOCK_SIZE);
+
+    (*this)[count] = node;
+    return count++;
+}
+
+ConcurrentDAG::ConcurrentDAG(const DAG& dag)
+    : m_level_count(dag.m_level_count)
+    , m_levels(dag.m_level_count)
+    , m_references(dag.m_level_count)
+    , m_index(dag.m_level_count)
+    , m_free(dag.m_level_count)
+{
+    for (auto& reader : m_readers)
+        reader.store(FREE_SLOT);
+
+    if (m_level_count < 2) {
+        m_levels[0].push_back(DAGNode());
+        return;
+    }
+
+    std::vector<std::unordered_map<uint32_t, uint32_t>> imported(m_level_count);
+    m_pending = dag.m_levels[0][0];
+    for (auto& ptr : m_pending.ptr) {
+        ptr = import(dag, 1, ptr, imported);
+        reference(1, ptr);
+    }
+
+    uint32_t root = allocate(0, m_pending);
+    for (uint32_t ptr : m_pending.ptr)
+        reference(1, ptr);
+    m_references[0][root] = 1;
+    m_root.store(root);
+}
+
+ConcurrentDAG::ReadGuard::ReadGuard(const ConcurrentDAG& dag)
+    : dag(dag)
+{
+    // Claiming the slot and loading the root are sequentially consistent, so
+    // a writer that did not see the slot had already published a root that
+    // does not reach what it reclaimed
+    for (uint32_t i = 0;; i = (i + 1) % MAX_READERS) {
+        uint64_t expected = FREE_SLOT;
+        if (dag.m_readers[i].compare_exchange_strong(expected, dag.m_epoch.load())) {
+            slot = i;
+            break;
+        }
+
+        if (i == MAX_READERS - 1)
+            std::this_thread::yield();
+    }
+
+    root_index = dag.m_root.load();
+}
+
+ConcurrentDAG::ReadGuard::~ReadGuard()
+{
+    dag.m_readers[slot].store(FREE_SLOT);
+}
+
+bool ConcurrentDAG::ReadGuard::get(uint32_t x, uint32_t y, uint32_t z) const
+{
+    uint32_t level_count = dag.m_level_count;
+    uint32_t pointer = root_index;
+
+    for (uint32_t level = 0; level < level_count - 1; level++) {
+        const auto& node = dag.m_levels[level][pointer];
+
+        uint32_t size = 1 << (level_count - level - 1);
+        uint32_t child = x / size + 2 * (y / size) + 4 * (z / size);
+
+        x %= size;
+        y %= size;
+        z %= size;
+
+        if ((node.children & (1 << child)) == 0)
+            return false;
+
+        pointer = node.ptr[child];
+    }
+
+    return (pointer & (1 << (x + 2 * y + 4 * z))) != 0;
+}
+
+void ConcurrentDAG::set(uint32_t x, uint32_t y, uint32_t z, bool value)
+{
+    if (m_level_count < 2)
+        return;
+
+    // Node and child index at every level of the path, the pending root first
+    std::vector<uint32_t> path(m_level_count - 1);
+    std::vector<uint32_t> path_child(m_level_count - 1);
+    uint32_t pointer = 0;
+
+    for (uint32_t level = 0; level < m_level_count - 1; level++) {
+        const auto& node = level == 0 ? m_pending : m_levels[level][pointer];
+
+        uint32_t size = 1 << (m_level_count - level - 1);
+        uint32_t child = x / size + 2 * (y / size) + 4 * (z / size);
+
+        x %= size;
+        y %= size;
+        z %= size;
+
+        path[level] = pointer;
+        path_child[level] = child;
+        pointer = node.ptr[child];
+    }
+
+    uint32_t bit = 1 << (x + 2 * y + 4 * z);
+    if (((pointer & bit) != 0) == value)
+        return;
+
+    uint32_t replacement = pointer ^ bit;
+
+    for (uint32_t level = m_level_count - 1; level-- > 1;) {
+        DAGNode node = m_levels[level][path[level]];
+        uint32_t child = path_child[level];
+
+        node.ptr[child] = replacement;
+        if (is_empty(level + 1, replacement))
+            node.children &= ~(1 << child);
+        else
+            node.children |= 1 << child;
+
+        replacement = find_or_insert(level, node);
+    }
+
+    // Referenced before the old child is released, which may be the same node
+    uint32_t child = path_child[0];
+    reference(1, replacement);
+    release(1, m_pending.ptr[child]);
+
+    m_pending.ptr[child] = replacement;
+    if (is_empty(1, replacement))
+        m_pending.children &= ~(1 << child);
+    else
+        m_pending.children |= 1 << child;
+}
+
+void ConcurrentDAG::publish()
+{
+    if (m_level_count < 2)
+        return;
+
+    uint32_t root = allocate(0, m_pending);
+    for (uint32_t ptr : m_pending.ptr)
+        reference(1, ptr);
+    m_references[0][root] = 1;
+
+    // Readers that start after the epoch advances see the new root, so what
+    // only the old one reached is retired in the epoch being closed
+    uint32_t old_root = m_root.exchange(root);
+    release(0, old_root);
+    m_epoch.fetch_add(1);
+
+    reclaim();
+}
+
+size_t ConcurrentDAG::reclaim()
+{
+    uint64_t oldest = m_epoch.load();
+    for (const auto& reader : m_readers)
+        oldest = std::min(oldest, reader.load());
+
+    size_t count = 0;
+    while (!m_retired.empty() && m_retired.front().epoch < oldest) {
+        const auto& retired = m_retired.front();
+        m_free[retired.level].push_back(retired.index);
+        m_retired.pop_front();
+        count++;
+    }
+
+    return count;
+}
+
+size_t ConcurrentDAG::node_count() const
+{
+    size_t count = 0;
+    for (uint32_t level = 0; level < m_level_count; level++)
+        count += m_levels[level].size() - m_free[level].size();
+
+    return count;
+}
+
+uint32_t ConcurrentDAG::allocate(uint32_t level, const DAGNode& node)
+{
+    uint32_t slot;
+    if (m_free[level].empty()) {
+        slot = m_levels[level].push_back(node);
+        m_references[level].push_back(0);
+    } else {
+        slot = m_free[level].back();
+        m_free[level].pop_back();
+        m_levels[level][slot] = node;
+        m_references[level][slot] = 0;
+    }
+
+    return slot;
+}
+
+uint32_t ConcurrentDAG::find_or_insert(uint32_t level, const DAGNode& node)
+{
+    auto it = m_index[level].find(node);
+    if (it != m_index[level].end())
+        return it->second;
+
+    uint32_t slot = allocate(level, node);
+    m_index[level].emplace(node, slot);
+    for (uint32_t ptr : node.ptr)
+        reference(level + 1, ptr);
+
+    return slot;
+}
+
+uint32_t ConcurrentDAG::import(const DAG& dag, uint32_t level, uint32_t pointer,
+    std::vector<std::unordered_map<uint32_t, uint32_t>>& imported)
+{
+    if (level == m_level_count - 1)
+        return pointer;
+
+    auto it = imported[level].find(pointer);
+    if (it != imported[level].end())
+        return it->second;
+
+    DAGNode node = dag.m_levels[level][pointer];
+    for (auto& ptr : node.ptr)
+        ptr = import(dag, level + 1, ptr, imported);
+
+    uint32_t result = find_or_insert(level, node);
+    imported[level].emplace(pointer, result);
+    return result;
+}
+
+void ConcurrentDAG::reference(uint32_t level, uint32_t index)
+{
+    if (level < m_level_count - 1)
+        m_references[level][index]++;
+}
+
+void ConcurrentDAG::release(uint32_t level, uint32_t index)
+{
+    if (level >= m_level_count - 1 || --m_references[level][index] > 0)
+        return;
+
+    const DAGNode& node = m_levels[level][index];
+    if (level > 0)
+        m_index[level].erase(node);
+    m_retired.push_back({level, index, m_epoch.load()});
+
+    for (uint32_t ptr : node.ptr)
+        release(level + 1, ptr);
+}
+
+bool ConcurrentDAG::is_empty(uint32_t level, uint32_t pointer) const
+{
+    if (level == m_level_count - 1)
+        return pointer == 0;
+
+    return m_levels[level][pointer].children == 0;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "dag.h"
+
+// Nodes of one level in fixed size blocks that never move once allocated, so
+// readers can follow pointers while the writer adds nodes
+class NodeArena {
+public:
+    static constexpr uint32_t BLOCK_BITS = 12;
+    static constexpr uint32_t BLOCK_SIZE = 1 << BLOCK_BITS;
+    static constexpr uint32_t MAX_BLOCKS = 4096;
+
+    NodeArena();
+
+    const DAGNode& operator[](uint32_t index) const { return blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)]; }
+    DAGNode& operator[](uint32_t index) { return blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)]; }
+    uint32_t size() const { return count; }
+
+    uint32_t push_back(const DAGNode& node);
+
+private:
+    // Sized once, only the pointers of new blocks are filled in
+    std::vector<std::unique_ptr<DAGNode[]>> blocks;
+    uint32_t count = 0;
+};
+
+static constexpr uint32_t MAX_READERS = 64;
+
+// A DAG that one writer edits while any number of readers query it. The writer
+// never changes a node a reader may reach: edits build new paths up to a
+// pending root, and publish() swaps the root readers start from. Readers pin
+// the epoch they started in, and nodes the writer no longer references are
+// reused only once every reader of an older epoch has finished, so readers
+// never wait for the writer and always see one consistent root.
+class ConcurrentDAG {
+public:
+    // Takes the nodes the working root of dag reaches
+    explicit ConcurrentDAG(const DAG& dag);
+
+    // A reader of the root published when it was created. At most MAX_READERS
+    // guards exist at once, further ones spin until a slot frees up.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const ConcurrentDAG& dag);
+        ~ReadGuard();
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        bool get(uint32_t x, uint32_t y, uint32_t z) const;
+        uint32_t root() const { return root_index; }
+        // Pointers of nodes at level L-2 are leaf masks, as in DAGNode::ptr
+        const DAGNode& node(uint32_t level, uint32_t index) const { return dag.m_levels[level][index]; }
+
+    private:
+        const ConcurrentDAG& dag;
+        uint32_t slot;
+        uint32_t root_index;
+    };
+
+    // The functions below are for the writer, from one thread at a time.
+    // Edits go to the pending root, which readers do not see until publish().
+    void set(uint32_t x, uint32_t y, uint32_t z, bool value);
+    void publish();
+    // Frees the nodes retired before the oldest epoch a reader is in, returns
+    // how many. publish() calls it too.
+    size_t reclaim();
+
+    // Nodes in use or waiting to be reclaimed, including roots
+    size_t node_count() const;
+    size_t retired_count() const { return m_retired.size(); }
+
+    uint32_t m_level_count = 0;
+
+private:
+    struct RetiredNode {
+        uint32_t level;
+        uint32_t index;
+        uint64_t epoch;
+    };
+
+    static constexpr uint64_t FREE_SLOT = UINT64_MAX;
+
+    uint32_t allocate(uint32_t level, const DAGNode& node);
+    uint32_t find_or_insert(uint32_t level, const DAGNode& node);
+    uint32_t import(const DAG& dag, uint32_t level, uint32_t pointer,
+        std::vector<std::unordered_map<uint32_t, uint32_t>>& imported);
+    void reference(uint32_t level, uint32_t index);
+    void release(uint32_t level, uint32_t index);
+    bool is_empty(uint32_t level, uint32_t pointer) const;
+
+    // Shared with readers
+    std::vector<NodeArena> m_levels;
+    std::atomic<uint32_t> m_root = 0;
+    std::atomic<uint64_t> m_epoch = 0;
+    mutable std::atomic<uint64_t> m_readers[MAX_READERS];
+
+    // Writer only. References count parents and roots, including the pending
+    // one, and nodes that lose their last one are retired.
+    DAGNode m_pending;
+    std::vector<std::vector<uint32_t>> m_references;
+    std::vector<std::unordered_map<DAGNode, uint32_t, DAGNodeHash>> m_index;
+    std::vector<std::vector<uint32_t>> m_free;
+    std::deque<RetiredNode> m_retired;
+};
@@ -1,10 +1,16 @@
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <bitset>
+#include <cmath>
 #include <cstdint>
 #include <iostream>
 #include <numeric>
+#include <thread>
 #include <vector>
 #include "dag.h"
+#include "diff.h"
+#include "raycast.h"
 
 std::ostream& operator<<(std::ostream& ostream, const DAGNode& node) {
     ostream << "[" << std::bitset<8>(node.children) << ": ";
@@ -18,6 +24,17 @@ std::ostream& operator<<(std::ostream& ostream, const DAGNode& node) {
     return ostream;
 }
 
+size_t DAGNodeHash::operator()(const DAGNode& node) const
+{
+    // FNV-1a over the pointers, which also determine the child mask
+    uint64_t hash = 0xcbf29ce484222325;
+    for (uint32_t ptr : node.ptr) {
+        hash ^= ptr;
+        hash *= 0x100000001b3;
+    }
+    return static_cast<size_t>(hash);
+}
+
 uint32_t make_leaf(const Map& map, int x0, int y0, int z0)
 {
     uint32_t children = 0;
@@ -61,12 +78,12 @@ void build_svdag(const Map& map, std::vector<std::vector<DAGNode>>& levels, uint
                         // L-2 is a special case: pointers are bit-packed values from L-1
                         if (level == level_count - 2) {
                             auto leaf = make_leaf(map, x0 + 4*x + 2*bx, y0 + 4*y + 2*by, z0 + 4*z + 2*bz);
-                            node.children |= 1 << i;
+                            node.children |= (leaf != 0) << i;
                             node.ptr[i] = leaf;
                         } else {
                             uint32_t index = (2*z+bz)*bs*bs+(2*y+by)*bs+(2*x+bx);
                             auto& bottom_node = bottom_level[index];
-                            node.children |= 1 << i;
+                            node.children |= (bottom_node.children != 0) << i;
                             node.ptr[i] = index;
                         }
                     }
@@ -126,7 +143,65 @@ DAG::DAG(const Map& map, uint32_t levels)
     build_svdag(map, m_levels, levels, 0, 0, 0);
 }
 
-bool DAG::get(uint32_t x, uint32_t y, uint32_t z) const {
+// Returns the index of the node at the given offset of the flattened words
+uint32_t unflatten(DAG& dag, const std::vector<uint32_t>& words, uint32_t level, uint32_t offset,
+    std::vector<std::unordered_map<uint32_t, uint32_t>>& visited)
+{
+    auto it = visited[level].find(offset);
+    if (it != visited[level].end())
+        return it->second;
+
+    bool is_last = level + 2 >= dag.m_level_count;
+    DAGNode node(words[offset]);
+
+    // Empty children have no word, they point to the empty node or mask
+    uint32_t next = offset + 1;
+    for (uint32_t i = 0; i < 8; i++) {
+        if ((node.children & (1 << i)) == 0)
+            node.ptr[i] = 0;
+        else if (is_last)
+            node.ptr[i] = words[next++];
+        else
+            node.ptr[i] = unflatten(dag, words, level + 1, words[next++], visited);
+    }
+
+    uint32_t index;
+    if (level == 0) {
+        index = 0;
+        dag.set_root(node);
+    } else {
+        index = dag.find_or_insert(level, node);
+    }
+
+    visited[level].emplace(offset, index);
+    return index;
+}
+
+DAG::DAG(uint32_t levels)
+{
+    m_level_count = levels;
+    m_levels.resize(levels);
+    if (levels < 2)
+        return;
+
+    // Every pointer of an empty node is 0, either to the empty node of the
+    // level below or as an empty leaf mask
+    for (uint32_t level = levels - 1; level-- > 1;)
+        find_or_insert(level, DAGNode());
+    m_levels[0].assign(1, DAGNode());
+}
+
+DAG::DAG(const std::vector<uint32_t>& words, uint32_t levels)
+    : DAG(levels)
+{
+    if (levels < 2 || words.empty())
+        return;
+
+    std::vector<std::unordered_map<uint32_t, uint32_t>> visited(levels);
+    unflatten(*this, words, 0, 0, visited);
+}
+
+bool DAG::get(uint32_t x, uint32_t y, uint32_t z, uint32_t max_level) const {
     uint32_t pointer = 0;
 
     uint32_t bx;
@@ -135,6 +210,8 @@ bool DAG::get(uint32_t x, uint32_t y, uint32_t z) const {
 
     for (uint32_t level = 0; level < m_level_count - 1; level++) {
         auto& node = m_levels[level][pointer];
+        if (level == max_level)
+            return node.children != 0;
 
         uint32_t size = 1 << (m_level_count - level - 1);
         bx = x / size;
@@ -145,12 +222,335 @@ bool DAG::get(uint32_t x, uint32_t y, uint32_t z) const {
         y -= by * size;
         z -= bz * size;
 
-        pointer = node.ptr[bx + 2*by + 4*bz];
+        uint32_t child = bx + 2*by + 4*bz;
+        if ((node.children & (1 << child)) == 0)
+            return false;
+
+        pointer = node.ptr[child];
     }
 
+    if (max_level == m_level_count - 1)
+        return pointer != 0;
+
     return (pointer & (1 << (x + 2*y + 4*z))) != 0;
 }
 
+void DAG::set(uint32_t x, uint32_t y, uint32_t z, bool value)
+{
+    if (m_level_count < 2 || get(x, y, z) == value)
+        return;
+
+    // Node and child index at every level of the path, root first
+    std::vector<uint32_t> path(m_level_count - 1);
+    std::vector<uint32_t> path_child(m_level_count - 1);
+    uint32_t pointer = 0;
+
+    for (uint32_t level = 0; level < m_level_count - 1; level++) {
+        uint32_t size = 1 << (m_level_count - level - 1);
+        uint32_t child = x / size + 2 * (y / size) + 4 * (z / size);
+
+        x %= size;
+        y %= size;
+        z %= size;
+
+        path[level] = pointer;
+        path_child[level] = child;
+        pointer = m_levels[level][pointer].ptr[child];
+    }
+
+    // The voxel differs from value, so flipping its bit sets it
+    uint32_t replacement = pointer ^ (1 << (x + 2*y + 4*z));
+
+    for (uint32_t level = m_level_count - 1; level-- > 0;) {
+        DAGNode node = m_levels[level][path[level]];
+        uint32_t child = path_child[level];
+
+        bool is_last = level + 2 >= m_level_count;
+        bool empty = is_last ? replacement == 0 : m_levels[level + 1][replacement].children == 0;
+
+        node.ptr[child] = replacement;
+        if (empty)
+            node.children &= ~(1 << child);
+        else
+            node.children |= 1 << child;
+
+        if (level == 0)
+            set_root(node);
+        else
+            replacement = find_or_insert(level, node);
+    }
+}
+
+uint32_t DAG::find_or_insert(uint32_t level, const DAGNode& node)
+{
+    build_index();
+
+    uint32_t slot = m_free[level].empty() ? static_cast<uint32_t>(m_levels[level].size()) : m_free[level].back();
+    auto [it, inserted] = m_index[level].emplace(node, slot);
+
+    if (inserted) {
+        if (slot == m_levels[level].size()) {
+            m_levels[level].push_back(node);
+        } else {
+            m_free[level].pop_back();
+            m_levels[level][slot] = node;
+        }
+    }
+
+    // A collection in progress must not free the node, nor what it points to
+    if (m_collection.active) {
+        m_collection.marked[level].resize(m_levels[level].size(), 0);
+        if (inserted) {
+            m_collection.marked[level][slot] = 1;
+            m_collection.gray.emplace_back(level, slot);
+        } else {
+            shade(level, it->second);
+        }
+    }
+
+    return it->second;
+}
+
+void DAG::set_root(const DAGNode& node)
+{
+    m_levels[0][0] = node;
+
+    if (m_collection.active)
+        m_collection.gray.emplace_back(0, 0);
+}
+
+void DAG::shade(uint32_t level, uint32_t index)
+{
+    auto& marked = m_collection.marked[level][index];
+    if (!marked) {
+        marked = 1;
+        m_collection.gray.emplace_back(level, index);
+    }
+}
+
+void DAG::collect_garbage(unsigned thread_count)
+{
+    if (m_level_count < 3)
+        return;
+
+    m_collection = GarbageCollection();
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    // Mark top down, one level at a time, each thread taking a range of the
+    // marked level and marking the children in the next
+    std::vector<std::vector<uint8_t>> marked(m_levels.size());
+    marked[0].assign(m_levels[0].size(), 1);
+
+    for (uint32_t level = 0; level + 2 < m_level_count; level++) {
+        const auto& nodes = m_levels[level];
+        std::vector<std::atomic<uint8_t>> next(m_levels[level + 1].size());
+
+        auto worker = [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                if (!marked[level][i])
+                    continue;
+
+                for (uint32_t ptr : nodes[i].ptr)
+                    next[ptr].store(1, std::memory_order_relaxed);
+            }
+        };
+
+        size_t chunk = (nodes.size() + thread_count - 1) / thread_count;
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < thread_count && i * chunk < nodes.size(); i++)
+            threads.emplace_back(worker, i * chunk, std::min((i + 1) * chunk, nodes.size()));
+        worker(0, std::min(chunk, nodes.size()));
+        for (auto& thread : threads)
+            thread.join();
+
+        marked[level + 1].resize(next.size());
+        for (size_t i = 0; i < next.size(); i++)
+            marked[level + 1][i] = next[i].load(std::memory_order_relaxed);
+    }
+
+    // Compact every level, then point the nodes of the level above at the new
+    // locations, like the mapped_pointers step of build_svdag()
+    std::vector<uint32_t> mapped_pointers;
+    for (uint32_t level = m_level_count - 1; level-- > 0;) {
+        auto& nodes = m_levels[level];
+        bool is_last = level + 2 >= m_level_count;
+
+        uint32_t result = 0;
+        std::vector<uint32_t> level_pointers(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (!marked[level][i])
+                continue;
+
+            DAGNode node = nodes[i];
+            if (!is_last) {
+                for (auto& ptr : node.ptr)
+                    ptr = mapped_pointers[ptr];
+            }
+
+            level_pointers[i] = result;
+            nodes[result++] = node;
+        }
+
+        nodes.erase(nodes.begin() + result, nodes.end());
+        nodes.shrink_to_fit();
+        mapped_pointers = std::move(level_pointers);
+    }
+
+    // Rebuilt on the next edit
+    m_index.clear();
+    m_free.clear();
+}
+
+bool DAG::collect_garbage_step(size_t budget)
+{
+    if (m_level_count < 3)
+        return true;
+
+    auto& collection = m_collection;
+    build_index();
+
+    if (!collection.active) {
+        collection.active = true;
+        collection.marking = true;
+        collection.marked.resize(m_levels.size());
+        for (size_t level = 0; level < m_levels.size(); level++)
+            collection.marked[level].assign(m_levels[level].size(), level == 0);
+
+        // Free slots are not swept again
+        for (size_t level = 0; level < m_free.size(); level++) {
+            for (uint32_t slot : m_free[level])
+                collection.marked[level][slot] = 1;
+        }
+
+        for (uint32_t i = 0; i < m_levels[0].size(); i++)
+            collection.gray.emplace_back(0, i);
+    }
+
+    size_t work = 0;
+    while (work < budget) {
+        work++;
+
+        // Edits can mark nodes while sweeping, those are finished first
+        if (!collection.gray.empty()) {
+            auto [level, index] = collection.gray.back();
+            collection.gray.pop_back();
+
+            // Dropped versions leave level 0 shorter
+            if (index >= m_levels[level].size())
+                continue;
+
+            if (level + 2 < m_level_count) {
+                for (uint32_t ptr : m_levels[level][index].ptr)
+                    shade(level + 1, ptr);
+            }
+            continue;
+        }
+
+        if (collection.marking) {
+            collection.marking = false;
+            collection.sweep_level = 1;
+            collection.sweep_index = 0;
+        }
+
+        if (collection.sweep_level + 1 >= m_level_count) {
+            collection = GarbageCollection();
+            return true;
+        }
+
+        uint32_t level = collection.sweep_level;
+        uint32_t index = collection.sweep_index++;
+        if (index >= m_levels[level].size()) {
+            collection.sweep_level++;
+            collection.sweep_index = 0;
+            continue;
+        }
+
+        if (index >= collection.marked[level].size() || collection.marked[level][index])
+            continue;
+
+        auto it = m_index[level].find(m_levels[level][index]);
+        if (it != m_index[level].end() && it->second == index)
+            m_index[level].erase(it);
+        m_free[level].push_back(index);
+    }
+
+    return false;
+}
+
+void DAG::snapshot(const std::string& name)
+{
+    DAGNode root = m_levels[0][0];
+    auto [it, inserted] = m_versions.emplace(name, static_cast<uint32_t>(m_levels[0].size()));
+    if (inserted)
+        m_levels[0].push_back(root);
+    else
+        m_levels[0][it->second] = root;
+
+    if (m_collection.active)
+        m_collection.gray.emplace_back(0, it->second);
+}
+
+bool DAG::rollback(const std::string& name)
+{
+    auto it = m_versions.find(name);
+    if (it == m_versions.end())
+        return false;
+
+    set_root(m_levels[0][it->second]);
+    return true;
+}
+
+bool DAG::drop_version(const std::string& name)
+{
+    auto it = m_versions.find(name);
+    if (it == m_versions.end())
+        return false;
+
+    // Move the last root into the gap
+    uint32_t index = it->second;
+    uint32_t last = static_cast<uint32_t>(m_levels[0].size() - 1);
+    m_versions.erase(it);
+
+    if (index != last) {
+        m_levels[0][index] = m_levels[0][last];
+        for (auto& [other, other_index] : m_versions) {
+            if (other_index == last)
+                other_index = index;
+        }
+
+        if (m_collection.active)
+            m_collection.gray.emplace_back(0, index);
+    }
+    m_levels[0].pop_back();
+
+    return true;
+}
+
+std::vector<VoxelBox> DAG::diff_versions(const std::string& from, const std::string& to) const
+{
+    auto root = [&](const std::string& name) {
+        return name.empty() ? 0 : m_versions.at(name);
+    };
+
+    return diff(*this, root(from), *this, root(to));
+}
+
+void DAG::build_index()
+{
+    if (!m_index.empty())
+        return;
+
+    m_index.resize(m_levels.size());
+    m_free.resize(m_levels.size());
+    for (size_t i = 1; i < m_levels.size(); i++) {
+        m_index[i].reserve(m_levels[i].size());
+        for (size_t j = 0; j < m_levels[i].size(); j++)
+            m_index[i].emplace(m_levels[i][j], static_cast<uint32_t>(j));
+    }
+}
+
 size_t DAG::total_size() const
 {
     size_t total_size = 0;
@@ -160,7 +560,153 @@ size_t DAG::total_size() const
     return total_size;
 }
 
-std::vector<uint32_t> DAG::flatten() const
+std::vector<uint32_t> DAG::flatten(uint32_t page_size) const
 {
+    // Only nodes reachable from a root are written, which leaves out slots
+    // freed by garbage collection and nodes it has not swept yet. Every root
+    // is kept so versions stay at their index.
+    std::vector<std::vector<bool>> reachable(m_levels.size());
+    for (size_t level = 0; level < m_levels.size(); level++)
+        reachable[level].assign(m_levels[level].size(), level == 0);
+
+    for (size_t level = 0; level + 2 < m_level_count && level + 1 < m_levels.size(); level++) {
+        for (size_t index = 0; index < m_levels[level].size(); index++) {
+            if (!reachable[level][index])
+                continue;
+
+            const auto& node = m_levels[level][index];
+            for (uint32_t i = 0; i < 8; i++) {
+                if (node.children & (1 << i))
+                    reachable[level + 1][node.ptr[i]] = true;
+            }
+        }
+    }
+
+    // Assign offsets level by level so that pointers into the next level are
+    // known before the nodes referencing them are written
+    std::vector<std::vector<uint32_t>> offsets(m_levels.size());
+    uint32_t total = 0;
+    for (size_t level = 0; level < m_levels.size(); level++) {
+        offsets[level].assign(m_levels[level].size(), 0);
+        for (size_t index = 0; index < m_levels[level].size(); index++) {
+            if (!reachable[level][index])
+                continue;
+
+            uint32_t size = 1 + std::popcount(m_levels[level][index].children);
+            if (page_size != 0 && total % page_size + size > page_size)
+                total += page_size - total % page_size;
+
+            offsets[level][index] = total;
+            total += size;
+        }
+    }
+
     std::vector<uint32_t> output;
+    output.reserve(total);
+
+    for (size_t level = 0; level < m_levels.size(); level++) {
+        bool is_last = level + 2 >= m_level_count;
+
+        for (size_t index = 0; index < m_levels[level].size(); index++) {
+            if (!reachable[level][index])
+                continue;
+
+            const auto& node = m_levels[level][index];
+            output.resize(offsets[level][index], 0);
+            output.push_back(node.children);
+            for (uint32_t i = 0; i < 8; i++) {
+                if ((node.children & (1 << i)) == 0)
+                    continue;
+
+                output.push_back(is_last ? node.ptr[i] : offsets[level + 1][node.ptr[i]]);
+            }
+        }
+    }
+
+    return output;
+}
+
+// Which nodes of each level are completely filled, bottom up
+std::vector<std::vector<bool>> find_full_nodes(const DAG& dag)
+{
+    std::vector<std::vector<bool>> full(dag.m_levels.size());
+
+    for (uint32_t level = dag.m_level_count - 1; level-- > 0;) {
+        bool is_last = level + 2 >= dag.m_level_count;
+
+        full[level].resize(dag.m_levels[level].size());
+        for (size_t i = 0; i < dag.m_levels[level].size(); i++) {
+            const auto& node = dag.m_levels[level][i];
+
+            bool is_full = node.children == 0xFF;
+            for (uint32_t j = 0; j < 8 && is_full; j++)
+                is_full = is_last ? node.ptr[j] == 0xFF : full[level + 1][node.ptr[j]];
+
+            full[level][i] = is_full;
+        }
+    }
+
+    return full;
+}
+
+bool write_dag_file(const std::string& path, const DAG& dag, uint32_t page_size)
+{
+    auto words = dag.flatten(page_size);
+
+    DAGFileHeader header;
+    header.level_count = dag.m_level_count;
+    header.page_size = page_size;
+    header.word_count = static_cast<uint32_t>(words.size());
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint32_t));
+
+    return file.good();
+}
+
+DAGFile::DAGFile(const std::string& path)
+    : file(path, std::ios::binary)
+{
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file.good() || header.magic != DAG_FILE_MAGIC || header.page_size == 0)
+        return;
+
+    // The traversal stack has room for MAX_LEVELS levels, and level L-2 is
+    // the lowest one with nodes
+    if (header.level_count < 2 || header.level_count > MAX_LEVELS)
+        return;
+
+    file.seekg(0, std::ios::end);
+    uint64_t words = (static_cast<uint64_t>(file.tellg()) - sizeof(header)) / sizeof(uint32_t);
+    open = file.good() && header.word_count <= words;
+}
+
+bool DAGFile::read_page(uint32_t page, std::vector<uint32_t>& output)
+{
+    if (!open || page >= header.page_count())
+        return false;
+
+    uint32_t first = page * header.page_size;
+    uint32_t count = std::min(header.page_size, header.word_count - first);
+
+    output.assign(header.page_size, 0);
+    file.clear();
+    file.seekg(sizeof(header) + static_cast<std::streamoff>(first) * sizeof(uint32_t));
+    file.read(reinterpret_cast<char*>(output.data()), count * sizeof(uint32_t));
+
+    return file.good();
+}
+
+bool DAGFile::read_all(std::vector<uint32_t>& output)
+{
+    if (!open)
+        return false;
+
+    output.resize(header.word_count);
+    file.clear();
+    file.seekg(sizeof(header));
+    file.read(reinterpret_cast<char*>(output.data()), output.size() * sizeof(uint32_t));
+
+    return file.good();
 }
@@ -1,6 +1,13 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <iosfwd>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #define REDUCE_SVO_TO_DAG 1
 
@@ -16,6 +23,9 @@ public:
 private:
 };
 
+// The 2x2x2 voxels from the given corner as a leaf mask
+uint32_t make_leaf(const Map& map, int x0, int y0, int z0);
+
 struct DAGNode {
     uint32_t children = 0;
     uint32_t ptr[8] = {0};
@@ -34,13 +44,132 @@ struct DAGNode {
 
 std::ostream& operator<<(std::ostream& ostream, const DAGNode& node);
 
+struct DAGNodeHash {
+    size_t operator()(const DAGNode& node) const;
+};
+
+// A cube of voxels
+struct VoxelBox {
+    uint32_t corner[3];
+    uint32_t size;
+};
+
+// State of an incremental collection, see DAG::collect_garbage_step()
+struct GarbageCollection {
+    bool active = false;
+    bool marking = false;
+    // Nodes reached from the root or created since the collection started
+    std::vector<std::vector<uint8_t>> marked;
+    // Marked nodes whose children are not marked yet, as (level, index)
+    std::vector<std::pair<uint32_t, uint32_t>> gray;
+    uint32_t sweep_level = 0;
+    uint32_t sweep_index = 0;
+};
+
 class DAG {
 public:
     explicit DAG(const Map& map, uint32_t levels);
-    bool get(uint32_t x, uint32_t y, uint32_t z) const;
+    // An empty volume, with the empty node of every level at index 0
+    explicit DAG(uint32_t levels);
+    // Rebuilds the nodes of the output of flatten(), such as the words of a DAG
+    // file, sharing equal nodes
+    DAG(const std::vector<uint32_t>& words, uint32_t levels);
+
+    // Descends at most to max_level, where the root is level 0 and single
+    // voxels are level L. A non-empty node at max_level counts as solid.
+    bool get(uint32_t x, uint32_t y, uint32_t z, uint32_t max_level = UINT32_MAX) const;
     size_t total_size() const;
-    std::vector<uint32_t> flatten() const;
+
+    // Nodes are shared, so instead of being modified in place the path from the
+    // root is rewritten bottom up. Each new node is reused from its level if an
+    // equal one exists and appended otherwise. Only the root is replaced in
+    // place, the nodes it no longer reaches stay in m_levels.
+    void set(uint32_t x, uint32_t y, uint32_t z, bool value);
+
+    // Index of a node equal to the given one in the level, added if missing
+    uint32_t find_or_insert(uint32_t level, const DAGNode& node);
+    void build_index();
+    void set_root(const DAGNode& node);
+
+    // Removes the nodes the root no longer reaches and renumbers the others in
+    // their original order. Marking is split over thread_count threads, 0 for
+    // one per core.
+    void collect_garbage(unsigned thread_count = 0);
+
+    // One part of an incremental collection, marking or sweeping about budget
+    // nodes. Returns true when a collection has finished. Unreachable nodes are
+    // not removed, their slots are reused by find_or_insert(), so edits can be
+    // made between calls without renumbering anything.
+    bool collect_garbage_step(size_t budget);
+
+    // Versions are further roots in level 0 that share every node with the
+    // working root at m_levels[0][0], which all other functions use. Taking a
+    // snapshot copies only the root node, replacing a version of the same name.
+    void snapshot(const std::string& name);
+    // Makes the version the working root again
+    bool rollback(const std::string& name);
+    // Nodes only the version reached are freed by the next garbage collection
+    bool drop_version(const std::string& name);
+    // The 2x2x2 voxel bricks that differ between the versions, or between a
+    // version and the working root for an empty name, see diff()
+    std::vector<VoxelBox> diff_versions(const std::string& from, const std::string& to) const;
+
+    // Flattened layout used by the renderer: every node is a child mask word
+    // followed by one word per non-empty child, in child order. For nodes at
+    // level L-2 these words are the 2x2x2 leaf masks, otherwise they are
+    // offsets of the child nodes in the returned buffer. The root is at 0.
+    //
+    // With a non-zero page_size, nodes are padded so that none of them crosses
+    // a multiple of page_size words, which lets the viewer stream the buffer in
+    // page sized pieces.
+    std::vector<uint32_t> flatten(uint32_t page_size = 0) const;
 
     uint32_t m_level_count = 0;
     std::vector<std::vector<DAGNode>> m_levels;
+    // Nodes below the root level by content, built on the first edit
+    std::vector<std::unordered_map<DAGNode, uint32_t, DAGNodeHash>> m_index;
+    // Slots of each level freed by collect_garbage_step()
+    std::vector<std::vector<uint32_t>> m_free;
+    GarbageCollection m_collection;
+    // Index of each version in level 0
+    std::map<std::string, uint32_t> m_versions;
+
+private:
+    void shade(uint32_t level, uint32_t index);
+};
+
+// Which nodes of each level, roots included, are completely filled
+std::vector<std::vector<bool>> find_full_nodes(const DAG& dag);
+
+static constexpr uint32_t DAG_FILE_MAGIC = 0x47445653; // "SVDG"
+static constexpr uint32_t DAG_PAGE_SIZE = 4096; // In words
+
+// A file holds this header followed by the words of DAG::flatten(page_size)
+struct DAGFileHeader {
+    uint32_t magic = DAG_FILE_MAGIC;
+    uint32_t level_count = 0;
+    uint32_t page_size = 0;
+    uint32_t word_count = 0;
+
+    uint32_t page_count() const { return (word_count + page_size - 1) / page_size; }
+};
+
+bool write_dag_file(const std::string& path, const DAG& dag, uint32_t page_size = DAG_PAGE_SIZE);
+
+// Reads a file written by write_dag_file() one page at a time
+class DAGFile {
+public:
+    explicit DAGFile(const std::string& path);
+
+    bool is_open() const { return open; }
+    const DAGFileHeader& get_header() const { return header; }
+
+    // The last page is zero padded to the full page size
+    bool read_page(uint32_t page, std::vector<uint32_t>& output);
+    bool read_all(std::vector<uint32_t>& output);
+
+private:
+    std::ifstream file;
+    DAGFileHeader header;
+    bool open = false;
 };
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include "dag.h"
+#include "diff.h"
+
+// Translates bottom up so that the children of a node are translated before
+// it. Nodes are unique within a DAG, so two subtrees are equal exactly when the
+// translated pointer matches.
+std::vector<std::vector<uint32_t>> translate_nodes(const DAG& from, const DAG& to)
+{
+    std::vector<std::vector<uint32_t>> translated(to.m_levels.size());
+
+    for (uint32_t level = to.m_level_count - 1; level-- > 1;) {
+        bool is_last = level + 2 >= to.m_level_count;
+
+        // Slots freed by incremental garbage collection may hold stale copies
+        std::vector<bool> is_free(from.m_levels[level].size());
+        if (level < from.m_free.size()) {
+            for (uint32_t slot : from.m_free[level])
+                is_free[slot] = true;
+        }
+
+        std::unordered_map<DAGNode, uint32_t, DAGNodeHash> index;
+        index.reserve(from.m_levels[level].size());
+        for (size_t i = 0; i < from.m_levels[level].size(); i++) {
+            if (!is_free[i])
+                index.emplace(from.m_levels[level][i], static_cast<uint32_t>(i));
+        }
+
+        translated[level].resize(to.m_levels[level].size(), NO_COUNTERPART);
+        for (size_t i = 0; i < to.m_levels[level].size(); i++) {
+            DAGNode node = to.m_levels[level][i];
+
+            bool found = true;
+            if (!is_last) {
+                for (auto& ptr : node.ptr) {
+                    ptr = translated[level + 1][ptr];
+                    found = found && ptr != NO_COUNTERPART;
+                }
+            }
+
+            auto it = index.find(node);
+            if (found && it != index.end())
+                translated[level][i] = it->second;
+        }
+    }
+
+    return translated;
+}
+
+struct DiffWalk {
+    const DAG& from;
+    const DAG& to;
+    // Empty when both sides share a pool
+    const std::vector<std::vector<uint32_t>>& translated;
+    uint32_t max_level;
+
+    void walk(uint32_t level, uint32_t from_node, uint32_t to_node, const uint32_t corner[3],
+        std::vector<VoxelBox>& output) const
+    {
+        bool is_leaf = level == from.m_level_count - 1;
+        uint32_t same = is_leaf || translated.empty() ? to_node : translated[level][to_node];
+        if (same == from_node)
+            return;
+
+        uint32_t size = 1 << (from.m_level_count - level);
+        if (is_leaf || level == max_level) {
+            output.push_back({{corner[0], corner[1], corner[2]}, size});
+            return;
+        }
+
+        const auto& a = from.m_levels[level][from_node];
+        const auto& b = to.m_levels[level][to_node];
+        uint32_t half = size >> 1;
+
+        for (uint32_t i = 0; i < 8; i++) {
+            uint32_t child_corner[3] = {
+                corner[0] + ((i & 1) ? half : 0),
+                corner[1] + ((i & 2) ? half : 0),
+                corner[2] + ((i & 4) ? half : 0),
+            };
+            walk(level + 1, a.ptr[i], b.ptr[i], child_corner, output);
+        }
+    }
+};
+
+std::vector<VoxelBox> diff(const DAG& from, uint32_t from_root, const DAG& to, uint32_t to_root,
+    uint32_t max_level, unsigned thread_count)
+{
+    uint32_t level_count = from.m_level_count;
+    std::vector<VoxelBox> output;
+    if (level_count < 2 || to.m_level_count != level_count)
+        return output;
+
+    std::vector<std::vector<uint32_t>> translated;
+    if (&from != &to)
+        translated = translate_nodes(from, to);
+
+    DiffWalk diff_walk{from, to, translated, std::max(max_level, 1u)};
+    const auto& a = from.m_levels[0][from_root];
+    const auto& b = to.m_levels[0][to_root];
+    uint32_t half = 1 << (level_count - 1);
+
+    std::vector<VoxelBox> octants[8];
+    std::atomic<uint32_t> next_octant = 0;
+    auto worker = [&] {
+        uint32_t i;
+        while ((i = next_octant.fetch_add(1)) < 8) {
+            uint32_t corner[3] = {(i & 1) ? half : 0, (i & 2) ? half : 0, (i & 4) ? half : 0};
+            diff_walk.walk(1, a.ptr[i], b.ptr[i], corner, octants[i]);
+        }
+    };
+
+    if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::min(thread_count, 8u); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    for (const auto& octant : octants)
+        output.insert(output.end(), octant.begin(), octant.end());
+
+    if (max_level == 0 && !output.empty())
+        output.assign(1, {{0, 0, 0}, 1u << level_count});
+
+    return output;
+}
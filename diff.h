@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class DAG;
+struct VoxelBox;
+
+static constexpr uint32_t NO_COUNTERPART = 0xFFFFFFFF;
+
+// For every node of `to` below the root level, the index of the equal node in
+// `from`, or NO_COUNTERPART
+std::vector<std::vector<uint32_t>> translate_nodes(const DAG& from, const DAG& to);
+
+// The cubes of nodes at max_level whose voxels differ between the two roots,
+// at most the 2x2x2 bricks of level L-1. Subtrees the two sides share are
+// skipped, so the time taken follows the size of the change rather than the
+// volume. The DAGs may be the same one, for diffing versions, or different
+// ones with the same level count, such as two DAGs read from files. The 8
+// octants of the root are diffed by thread_count threads, 0 for one per core.
+std::vector<VoxelBox> diff(const DAG& from, uint32_t from_root, const DAG& to, uint32_t to_root,
+    uint32_t max_level = UINT32_MAX, unsigned thread_count = 0);
@@ -6,8 +6,12 @@ out vec4 color;
 
 uniform sampler2D frame_texture;
 
+// The traced image only covers the bottom left u_resolution texels of the
+// frame texture and is stretched over the whole screen.
+layout (location = 0) uniform ivec2 u_resolution;
+
 void main()
 {
-    color = texture(frame_texture, v_uv);
+    vec2 texel = clamp(v_uv * vec2(u_resolution), vec2(0.5), vec2(u_resolution) - 0.5);
+    color = texture(frame_texture, texel / vec2(textureSize(frame_texture, 0)));
 }
-
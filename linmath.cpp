@@ -35,6 +35,31 @@ Vec3& Vec3::operator*(float rhs)
     return *this;
 }
 
+Vec3 operator+(Vec3 lhs, Vec3 rhs)
+{
+    return {lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z};
+}
+
+Vec3 operator-(Vec3 lhs, Vec3 rhs)
+{
+    return {lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z};
+}
+
+Vec3 operator-(Vec3 rhs)
+{
+    return {-rhs.x, -rhs.y, -rhs.z};
+}
+
+Vec3 operator*(float lhs, Vec3 rhs)
+{
+    return {lhs * rhs.x, lhs * rhs.y, lhs * rhs.z};
+}
+
+float dot(Vec3 lhs, Vec3 rhs)
+{
+    return lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z;
+}
+
 Vec3 cross(Vec3 lhs, Vec3 rhs)
 {
     return {
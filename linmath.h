@@ -18,12 +18,19 @@ struct Vec3 {
     Vec3& operator+=(Vec3 rhs);
     Vec3& operator-=(Vec3 rhs);
     Vec3& operator*(float rhs);
+    bool operator==(const Vec3& rhs) const = default;
 
     const float* ptr() const { return &x; }
 };
 
 static constexpr Vec3 UP = Vec3(0, 1, 0);
 
+Vec3 operator+(Vec3 lhs, Vec3 rhs);
+Vec3 operator-(Vec3 lhs, Vec3 rhs);
+Vec3 operator-(Vec3 rhs);
+Vec3 operator*(float lhs, Vec3 rhs);
+
+float dot(Vec3 lhs, Vec3 rhs);
 Vec3 cross(Vec3 lhs, Vec3 rhs);
 float length(Vec3 lhs);
 Vec3 normalize(Vec3 lhs);
@@ -0,0 +1,173 @@
+#include <bit>
+#include <thread>
+#include "node-index.h"
+
+// A slot is empty, BUSY while the claiming thread writes its node, a node
+// index as (index << 2) | ENTRY_BIT, or a pointer to a directory one level
+// down the trie, whose low bits are 0
+static constexpr uint64_t EMPTY = 0;
+static constexpr uint64_t BUSY = 1;
+static constexpr uint64_t ENTRY_BIT = 2;
+
+static constexpr uint32_t ROOT_BITS = 12;
+static constexpr uint32_t DIRECTORY_BITS = 4;
+static constexpr uint32_t DIRECTORY_SIZE = 1 << DIRECTORY_BITS;
+
+// Once the 64 bits of the hash are used up, which takes equal hashes of
+// different nodes, further directories are probed linearly and chained
+// through their last slot
+static constexpr uint32_t HASH_BITS = 64;
+static constexpr uint32_t CHAIN_SLOT = DIRECTORY_SIZE - 1;
+
+uint64_t node_hash(const DAGNode& node)
+{
+    // DAGNodeHash spreads the pointers into the high bits, the trie starts
+    // from the low ones
+    uint64_t hash = DAGNodeHash()(node);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void delete_directory(uint64_t word)
+{
+    auto* slots = reinterpret_cast<std::atomic<uint64_t>*>(word);
+    for (uint32_t i = 0; i < DIRECTORY_SIZE; i++) {
+        uint64_t child = slots[i].load();
+        if (child != EMPTY && (child & (BUSY | ENTRY_BIT)) == 0)
+            delete_directory(child);
+    }
+    delete[] slots;
+}
+
+NodeIndex::NodeIndex(uint32_t level_count, uint64_t (*hash)(const DAGNode& node))
+    : m_levels(level_count)
+    , m_hash(hash)
+{
+    for (auto& level : m_levels)
+        level.root = std::make_unique<std::atomic<uint64_t>[]>(1 << ROOT_BITS);
+}
+
+NodeIndex::~NodeIndex()
+{
+    for (auto& level : m_levels) {
+        for (auto& segment : level.segments)
+            delete[] segment.load();
+
+        for (uint32_t i = 0; i < (1u << ROOT_BITS); i++) {
+            uint64_t word = level.root[i].load();
+            if (word != EMPTY && (word & (BUSY | ENTRY_BIT)) == 0)
+                delete_directory(word);
+        }
+    }
+}
+
+const DAGNode& NodeIndex::node(uint32_t level, uint32_t index) const
+{
+    uint64_t position = static_cast<uint64_t>(index) + (1 << FIRST_SEGMENT_BITS);
+    uint32_t segment = std::bit_width(position) - 1 - FIRST_SEGMENT_BITS;
+    uint64_t offset = position - (uint64_t(1) << (segment + FIRST_SEGMENT_BITS));
+    return m_levels[level].segments[segment].load(std::memory_order_acquire)[offset];
+}
+
+uint32_t NodeIndex::allocate(Level& level, const DAGNode& node)
+{
+    uint32_t index = level.count.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t position = static_cast<uint64_t>(index) + (1 << FIRST_SEGMENT_BITS);
+    uint32_t segment = std::bit_width(position) - 1 - FIRST_SEGMENT_BITS;
+    uint64_t offset = position - (uint64_t(1) << (segment + FIRST_SEGMENT_BITS));
+
+    // The first thread to need a segment allocates it, others that raced it
+    // throw theirs away
+    DAGNode* nodes = level.segments[segment].load(std::memory_order_acquire);
+    if (!nodes) {
+        auto* allocated = new DAGNode[size_t(1) << (segment + FIRST_SEGMENT_BITS)];
+        if (level.segments[segment].compare_exchange_strong(nodes, allocated, std::memory_order_acq_rel))
+            nodes = allocated;
+        else
+            delete[] allocated;
+    }
+
+    nodes[offset] = node;
+    return index;
+}
+
+uint32_t NodeIndex::find_or_insert(uint32_t level_index, const DAGNode& node)
+{
+    auto& level = m_levels[level_index];
+    uint64_t hash = m_hash(node);
+
+    // Directories are indexed by the next DIRECTORY_BITS of the hash until the
+    // hash is used up, after which they are chained
+    std::atomic<uint64_t>* slots = level.root.get();
+    uint32_t slot_index = hash & ((1 << ROOT_BITS) - 1);
+    uint32_t used_bits = ROOT_BITS;
+    bool chained = false;
+
+    while (true) {
+        auto& slot = slots[slot_index];
+        uint64_t word = slot.load(std::memory_order_acquire);
+
+        if (word == EMPTY && !(chained && slot_index == CHAIN_SLOT)) {
+            if (slot.compare_exchange_strong(word, BUSY, std::memory_order_acq_rel)) {
+                uint32_t index = allocate(level, node);
+                slot.store((static_cast<uint64_t>(index) << 2) | ENTRY_BIT, std::memory_order_release);
+                return index;
+            }
+        }
+
+        // Likely the same node, which is written shortly. This is the one place
+        // an inserter waits for another.
+        if (word == BUSY) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (word & ENTRY_BIT) {
+            uint32_t other = static_cast<uint32_t>(word >> 2);
+            const DAGNode& existing = this->node(level_index, other);
+            if (existing == node)
+                return other;
+
+            if (chained) {
+                slot_index++;
+                continue;
+            }
+
+            // Moves the other node one level down, then retries there
+            auto* directory = new std::atomic<uint64_t>[DIRECTORY_SIZE]();
+            bool will_chain = used_bits + DIRECTORY_BITS > HASH_BITS;
+            uint32_t other_slot = will_chain ? 0 : (m_hash(existing) >> used_bits) & (DIRECTORY_SIZE - 1);
+            directory[other_slot].store(word, std::memory_order_relaxed);
+
+            if (!slot.compare_exchange_strong(word, reinterpret_cast<uint64_t>(directory), std::memory_order_acq_rel)) {
+                delete[] directory;
+                continue;
+            }
+            word = reinterpret_cast<uint64_t>(directory);
+        }
+
+        if (word == EMPTY) {
+            // The chain slot of a full directory
+            auto* directory = new std::atomic<uint64_t>[DIRECTORY_SIZE]();
+            if (!slot.compare_exchange_strong(word, reinterpret_cast<uint64_t>(directory), std::memory_order_acq_rel)) {
+                delete[] directory;
+                continue;
+            }
+            word = reinterpret_cast<uint64_t>(directory);
+        }
+
+        slots = reinterpret_cast<std::atomic<uint64_t>*>(word);
+        if (chained || used_bits + DIRECTORY_BITS > HASH_BITS) {
+            chained = true;
+            slot_index = 0;
+        } else {
+            slot_index = (hash >> used_bits) & (DIRECTORY_SIZE - 1);
+            used_bits += DIRECTORY_BITS;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "dag.h"
+
+uint64_t node_hash(const DAGNode& node);
+
+// Deduplicates nodes that many threads insert at once. Every level has its
+// own hash trie over its own nodes, so levels never contend with each other,
+// and both grow with the nodes actually inserted. A slot holding another node
+// is split into a directory on the next bits of both hashes.
+//
+// Descending and splitting the trie take no locks, but inserting is not
+// strictly lock-free: a thread claims an empty slot, writes the node and then
+// publishes its index, and threads probing that slot in between wait for it.
+// They only do so for a node with the same slot, most likely the same node.
+class NodeIndex {
+public:
+    // The hash is replaceable to test collisions
+    explicit NodeIndex(uint32_t level_count, uint64_t (*hash)(const DAGNode& node) = node_hash);
+    ~NodeIndex();
+
+    NodeIndex(const NodeIndex&) = delete;
+    NodeIndex& operator=(const NodeIndex&) = delete;
+
+    // Index of the node equal to the given one in the level, added if missing.
+    // Equal nodes inserted concurrently get the same index.
+    uint32_t find_or_insert(uint32_t level, const DAGNode& node);
+
+    uint32_t size(uint32_t level) const { return m_levels[level].count.load(); }
+    // Nodes up to size(level) are complete once the inserting threads are done
+    const DAGNode& node(uint32_t level, uint32_t index) const;
+
+private:
+    // Nodes are stored in segments, segment k holding FIRST_SEGMENT_SIZE << k
+    static constexpr uint32_t FIRST_SEGMENT_BITS = 10;
+    static constexpr uint32_t SEGMENT_COUNT = 32 - FIRST_SEGMENT_BITS;
+
+    struct Level {
+        std::atomic<uint32_t> count = 0;
+        std::atomic<DAGNode*> segments[SEGMENT_COUNT] = {};
+        std::unique_ptr<std::atomic<uint64_t>[]> root;
+    };
+
+    uint32_t allocate(Level& level, const DAGNode& node);
+
+    std::vector<Level> m_levels;
+    uint64_t (*m_hash)(const DAGNode& node);
+};
@@ -1,9 +1,60 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <cmath>
+#include "ao.h"
+#include "brush.h"
+#include "builder.h"
+#include "combine.h"
+#include "concurrent-dag.h"
 #include "dag.h"
+#include "diff.h"
+#include "node-index.h"
+#include "raycast.h"
+#include <thread>
 
-int main()
+// Prints the 2x2x2 bricks that differ between two DAG files
+int diff_files(const std::string& from_path, const std::string& to_path)
 {
+    std::vector<uint32_t> words[2];
+    uint32_t level_count[2];
+    const std::string* paths[2] = {&from_path, &to_path};
+    for (int i = 0; i < 2; i++) {
+        DAGFile file(*paths[i]);
+        if (!file.read_all(words[i])) {
+            std::cout << "failed to read " << *paths[i] << std::endl;
+            return 1;
+        }
+        level_count[i] = file.get_header().level_count;
+    }
+
+    if (level_count[0] != level_count[1]) {
+        std::cout << "level counts differ" << std::endl;
+        return 1;
+    }
+
+    DAG from(words[0], level_count[0]);
+    DAG to(words[1], level_count[1]);
+    for (const auto& brick : diff(from, 0, to, 0)) {
+        std::cout << brick.corner[0] << ", " << brick.corner[1] << ", " << brick.corner[2] << std::endl;
+    }
+
+    return 0;
+}
+
+// Usage: precompute-dag [output file]
+//        precompute-dag --diff <file> <file>
+//
+// With an output file, the DAG is also written in the paged format that
+// view-dag --stream reads, and its ambient occlusion is baked into the same
+// path with .ao appended, for view-dag --ao.
+int main(int argc, char** argv)
+{
+    if (argc == 4 && std::string(argv[1]) == "--diff")
+        return diff_files(argv[2], argv[3]);
+
     std::cout << "precompute-dag" << std::endl;
 
     Map map;
@@ -14,6 +65,132 @@ int main()
     auto dt = end - start;
     std::cout << "dt=" << std::chrono::duration_cast<std::chrono::milliseconds>(dt) << std::endl;
 
+    // The task based builder must build the same volume with the same nodes,
+    // whatever the thread count
+    for (unsigned thread_count : {1u, 3u, 0u}) {
+        start = std::chrono::high_resolution_clock::now();
+        DAG built = build_dag(map, 7, thread_count);
+        end = std::chrono::high_resolution_clock::now();
+
+        bool same_sizes = built.m_levels.size() == dag.m_levels.size();
+        for (size_t level = 0; same_sizes && level < dag.m_levels.size(); level++)
+            same_sizes = built.m_levels[level].size() == dag.m_levels[level].size();
+
+        if (!diff(dag, 0, built, 0).empty() || !same_sizes || built.flatten() != dag.flatten()) {
+            std::cout << "builder error: the DAG differs from building level by level with "
+                      << thread_count << " threads" << std::endl;
+        }
+        std::cout << "builder: " << thread_count << " threads, dt=" << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+    }
+
+    // Levels grow with the nodes inserted, deeper volumes need no capacities
+    {
+        DAG reference(map, 9);
+        start = std::chrono::high_resolution_clock::now();
+        DAG built = build_dag(map, 9);
+        end = std::chrono::high_resolution_clock::now();
+
+        if (built.flatten() != reference.flatten()) {
+            std::cout << "builder error: the 9 level DAG differs from building level by level" << std::endl;
+        }
+        std::cout << "builder: 9 levels, dt=" << std::chrono::duration_cast<std::chrono::milliseconds>(end - start) << std::endl;
+    }
+
+    // A floor with a wall along one side: the baked voxels must be exactly the
+    // exposed ones, the open floor must see the whole sky and the corner
+    // against the wall about half of it
+    {
+        DAG scene(5);
+        uint32_t floor_min[3] = {0, 0, 0};
+        uint32_t floor_max[3] = {32, 4, 32};
+        uint32_t wall_min[3] = {0, 0, 0};
+        uint32_t wall_max[3] = {2, 32, 32};
+        apply_brush(scene, BoxBrush(floor_min, floor_max), BrushOp::Union);
+        apply_brush(scene, BoxBrush(wall_min, wall_max), BrushOp::Union);
+
+        start = std::chrono::high_resolution_clock::now();
+        auto ao = bake_ambient_occlusion(scene);
+        end = std::chrono::high_resolution_clock::now();
+
+        std::vector<uint32_t> expected;
+        for (uint32_t z = 0; z < 32; z++) {
+            for (uint32_t y = 0; y < 32; y++) {
+                for (uint32_t x = 0; x < 32; x++) {
+                    if (!scene.get(x, y, z))
+                        continue;
+
+                    bool exposed = x == 0 || y == 0 || z == 0 || x == 31 || y == 31 || z == 31
+                        || !scene.get(x - 1, y, z) || !scene.get(x + 1, y, z)
+                        || !scene.get(x, y - 1, z) || !scene.get(x, y + 1, z)
+                        || !scene.get(x, y, z - 1) || !scene.get(x, y, z + 1);
+                    if (exposed)
+                        expected.push_back(morton_code(x, y, z));
+                }
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        if (ao.keys != expected) {
+            std::cout << "ao error: " << ao.keys.size() << " voxels baked, " << expected.size() << " exposed" << std::endl;
+        }
+
+        float open = ao.lookup(20, 3, 16, face_index(1, true));
+        float corner = ao.lookup(2, 3, 16, face_index(1, true));
+        float wall = ao.lookup(1, 4, 16, face_index(0, true));
+        if (open != 1.0f) {
+            std::cout << "ao error: open floor sees " << open << " of the sky" << std::endl;
+        }
+        if (corner < 0.4f || corner > 0.6f) {
+            std::cout << "ao error: floor against the wall sees " << corner << " of the sky" << std::endl;
+        }
+        if (wall < 0.4f || wall > 0.6f) {
+            std::cout << "ao error: wall above the floor sees " << wall << " of the sky" << std::endl;
+        }
+        if (ao.lookup(16, 2, 16, face_index(1, true)) != 1.0f
+            || std::binary_search(ao.keys.begin(), ao.keys.end(), morton_code(16, 2, 16))) {
+            std::cout << "ao error: a buried voxel was baked" << std::endl;
+        }
+
+        std::cout << "ao: " << ao.keys.size() << " surface voxels, corner " << corner << ", dt="
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start) << std::endl;
+    }
+
+    // Rebuilding the dirty boxes must bring them back to the map and leave
+    // every other voxel alone
+    {
+        DAG stale(map, 7);
+        uint32_t box_min[3] = {90, 10, 90};
+        uint32_t box_max[3] = {120, 30, 120};
+        apply_brush(stale, SphereBrush(40.0f, 50.0f, 30.0f, 20.0f), BrushOp::Union);
+        apply_brush(stale, BoxBrush(box_min, box_max), BrushOp::Subtract);
+
+        // The sphere and one corner of the box
+        std::vector<DirtyBox> dirty = {
+            {{19, 29, 9}, {61, 71, 51}},
+            {{90, 10, 90}, {100, 17, 100}},
+        };
+
+        DAG expected = stale;
+        for (const auto& box : dirty) {
+            for (uint32_t z = box.min[2]; z < box.max[2]; z++) {
+                for (uint32_t y = box.min[1]; y < box.max[1]; y++) {
+                    for (uint32_t x = box.min[0]; x < box.max[0]; x++)
+                        expected.set(x, y, z, map.get(x, y, z));
+                }
+            }
+        }
+
+        start = std::chrono::high_resolution_clock::now();
+        rebuild(stale, map, dirty);
+        end = std::chrono::high_resolution_clock::now();
+
+        auto differences = diff(expected, 0, stale, 0);
+        if (!differences.empty()) {
+            std::cout << "rebuild error: " << differences.size() << " bricks differ" << std::endl;
+        }
+        std::cout << "rebuild: dt=" << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+    }
+
     for (int z = 108; z < 109; z++) {
         for (int y = 0; y < 128; y++) {
             for (int x = 64; x < 128; x++) {
@@ -26,5 +203,612 @@ int main()
         }
     }
 
+    // Every ray hit must land in a solid voxel, entered through an empty one
+    auto nodes = dag.flatten();
+    Vec3 origin(-10.5f, 150.25f, -20.75f);
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            Vec3 target(2.0f * x + 0.5f, 0.0f, 2.0f * y + 0.5f);
+            Vec3 dir = normalize(target - origin);
+            RayHit hit = raycast(nodes, dag.m_level_count, origin, dir);
+            if (!hit.hit)
+                continue;
+
+            Vec3 p = origin + hit.distance * dir;
+            Vec3 inside = p - 0.5f * hit.normal;
+            Vec3 outside = p + 0.5f * hit.normal;
+            auto solid = [&](Vec3 v) {
+                if (v.x < 0 || v.y < 0 || v.z < 0)
+                    return false;
+                return dag.get(static_cast<uint32_t>(std::floor(v.x)), static_cast<uint32_t>(std::floor(v.y)), static_cast<uint32_t>(std::floor(v.z)));
+            };
+
+            if (!solid(inside) || (outside.x < 128 && outside.y < 128 && outside.z < 128 && solid(outside))) {
+                std::cout << "raycast error at " << p << " normal " << hit.normal << std::endl;
+            }
+        }
+    }
+
+    // A coarse query is solid when any voxel in its block is
+    for (uint32_t max_level = 1; max_level < dag.m_level_count; max_level++) {
+        uint32_t size = 1 << (dag.m_level_count - max_level);
+        for (uint32_t i = 0; i < 64; i++) {
+            uint32_t bx = (i * 37) % (128 / size) * size;
+            uint32_t by = (i * 11) % (128 / size) * size;
+            uint32_t bz = (i * 23) % (128 / size) * size;
+
+            bool any = false;
+            for (uint32_t z = bz; z < bz + size; z++)
+                for (uint32_t y = by; y < by + size; y++)
+                    for (uint32_t x = bx; x < bx + size; x++)
+                        any = any || dag.get(x, y, z);
+
+            if (dag.get(bx, by, bz, max_level) != any) {
+                std::cout << "error at level " << max_level << " block " << bx << ", " << by << ", " << bz << std::endl;
+            }
+        }
+    }
+
+    // Paging must not change what a ray hits
+    auto paged_nodes = dag.flatten(64);
+    for (int i = 0; i < 256; i++) {
+        Vec3 dir = normalize(Vec3(0.25f + 0.01f * i, -0.5f, 0.3f + 0.002f * i));
+        RayHit a = raycast(nodes, dag.m_level_count, origin, dir);
+        RayHit b = raycast(paged_nodes, dag.m_level_count, origin, dir);
+        if (a.hit != b.hit || a.distance != b.distance) {
+            std::cout << "paged raycast error for direction " << dir << std::endl;
+        }
+    }
+
+    // Edits must read back, and undoing them must restore the original nodes
+    {
+        DAG edited = dag;
+        std::vector<std::array<uint32_t, 3>> voxels;
+        std::vector<bool> is_edited(128 * 128 * 128);
+        uint32_t seed = 1;
+        for (uint32_t i = 0; i < 4096; i++) {
+            seed = seed * 1664525 + 1013904223;
+            uint32_t x = seed >> 25, y = (seed >> 18) & 127, z = (seed >> 11) & 127;
+            if (!is_edited[(z * 128 + y) * 128 + x])
+                voxels.push_back({x, y, z});
+            is_edited[(z * 128 + y) * 128 + x] = true;
+        }
+
+        start = std::chrono::high_resolution_clock::now();
+        for (const auto& [x, y, z] : voxels)
+            edited.set(x, y, z, !map.get(x, y, z));
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "set: " << voxels.size() << " voxels, dt="
+                  << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+
+        for (const auto& [x, y, z] : voxels) {
+            if (edited.get(x, y, z) == map.get(x, y, z)) {
+                std::cout << "set error at " << x << ", " << y << ", " << z << std::endl;
+            }
+        }
+
+        for (uint32_t z = 0; z < 128; z++) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    if (!is_edited[(z * 128 + y) * 128 + x] && edited.get(x, y, z) != map.get(x, y, z)) {
+                        std::cout << "set changed " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+
+        for (const auto& [x, y, z] : voxels)
+            edited.set(x, y, z, map.get(x, y, z));
+
+        if (!(edited.m_levels[0][0] == dag.m_levels[0][0])) {
+            std::cout << "set error: undoing every edit did not restore the root" << std::endl;
+        }
+
+        // Nothing but the original nodes is reachable again
+        edited.collect_garbage();
+        if (edited.m_levels != dag.m_levels) {
+            std::cout << "garbage collection error: undone edits were not removed" << std::endl;
+        }
+    }
+
+    // Incremental collection between edits must keep every reachable node, and
+    // keep the node count bounded
+    {
+        DAG edited = dag;
+        DAG reference = dag;
+        uint32_t box_min[3] = {0, 0, 0};
+        uint32_t box_max[3] = {0, 0, 0};
+        size_t max_nodes = 0;
+        size_t collections = 0;
+
+        for (uint32_t i = 0; i < 64; i++) {
+            box_min[0] = (i * 37) % 100;
+            box_min[1] = (i * 13) % 100;
+            box_min[2] = (i * 71) % 100;
+            for (int j = 0; j < 3; j++)
+                box_max[j] = box_min[j] + 5 + (i * (j + 3)) % 23;
+
+            BoxBrush box(box_min, box_max);
+            BrushOp op = i % 2 ? BrushOp::Union : BrushOp::Subtract;
+            apply_brush(edited, box, op);
+            apply_brush(reference, box, op);
+            edited.set(i, 127 - i, i, i % 3 == 0);
+            reference.set(i, 127 - i, i, i % 3 == 0);
+
+            // Undoing an edit brings back nodes the collection may have found
+            // unreachable already
+            bool value = edited.get(2 * i, i, (3 * i) % 128);
+            edited.set(2 * i, i, (3 * i) % 128, !value);
+            if (edited.collect_garbage_step(500))
+                collections++;
+            edited.set(2 * i, i, (3 * i) % 128, value);
+            if (edited.collect_garbage_step(500))
+                collections++;
+
+            size_t nodes = 0;
+            for (const auto& level : edited.m_levels)
+                nodes += level.size();
+            max_nodes = std::max(max_nodes, nodes);
+        }
+
+        while (!edited.collect_garbage_step(2000)) {
+        }
+
+        for (uint32_t z = 0; z < 128; z++) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    if (edited.get(x, y, z) != reference.get(x, y, z)) {
+                        std::cout << "incremental garbage collection error at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+
+        size_t reference_nodes = 0;
+        for (const auto& level : reference.m_levels)
+            reference_nodes += level.size();
+
+        reference.collect_garbage();
+        size_t live_nodes = 0;
+        for (const auto& level : reference.m_levels)
+            live_nodes += level.size();
+
+        std::cout << "gc: " << collections << " incremental collections, at most " << max_nodes
+                  << " nodes, " << reference_nodes << " without collection, " << live_nodes << " live" << std::endl;
+
+        // Slots freed by the incremental collection are not flattened
+        if (edited.flatten().size() != reference.flatten().size()) {
+            std::cout << "garbage collection error: flatten kept unreachable nodes" << std::endl;
+        }
+
+        edited.collect_garbage();
+        for (uint32_t z = 0; z < 128; z += 5) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    if (edited.get(x, y, z) != reference.get(x, y, z)) {
+                        std::cout << "garbage collection error at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    // Brush edits must match testing every voxel against the brushes, and must
+    // not depend on the thread count
+    {
+        uint32_t box_min[3] = {10, 40, 20};
+        uint32_t box_max[3] = {90, 70, 128};
+        uint32_t mask_origin[3] = {50, 3, 77};
+        uint32_t mask_size[3] = {17, 23, 29};
+        std::vector<bool> mask_voxels(mask_size[0] * mask_size[1] * mask_size[2]);
+        for (size_t i = 0; i < mask_voxels.size(); i++)
+            mask_voxels[i] = (i * 7) % 3 == 0;
+
+        SphereBrush sphere(64.0f, 50.0f, 70.5f, 30.0f);
+        BoxBrush box(box_min, box_max);
+        MaskBrush mask(mask_origin, mask_size, mask_voxels);
+
+        DAG edited = dag;
+        start = std::chrono::high_resolution_clock::now();
+        apply_brush(edited, sphere, BrushOp::Union);
+        apply_brush(edited, box, BrushOp::Subtract);
+        apply_brush(edited, mask, BrushOp::Union);
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "brushes: dt=" << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+
+        DAG serial = dag;
+        apply_brush(serial, sphere, BrushOp::Union, 1);
+        apply_brush(serial, box, BrushOp::Subtract, 1);
+        apply_brush(serial, mask, BrushOp::Union, 1);
+
+        if (!(edited.m_levels[0][0] == serial.m_levels[0][0])) {
+            std::cout << "brush error: result depends on the thread count" << std::endl;
+        }
+
+        for (uint32_t z = 0; z < 128; z++) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    bool expected = map.get(x, y, z);
+                    expected = expected || sphere.contains(x, y, z);
+                    expected = expected && !box.contains(x, y, z);
+                    expected = expected || mask.contains(x, y, z);
+                    if (edited.get(x, y, z) != expected) {
+                        std::cout << "brush error at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    // Versions must keep their voxels while the working root is edited, and the
+    // diff must cover exactly the bricks with changed voxels
+    {
+        DAG versioned = dag;
+        versioned.snapshot("base");
+
+        uint32_t box_min[3] = {30, 0, 30};
+        uint32_t box_max[3] = {34, 128, 90};
+        apply_brush(versioned, SphereBrush(90.0f, 90.0f, 40.0f, 20.0f), BrushOp::Subtract);
+        apply_brush(versioned, BoxBrush(box_min, box_max), BrushOp::Union);
+        versioned.snapshot("edited");
+        versioned.set(5, 5, 5, !versioned.get(5, 5, 5));
+
+        auto bricks = versioned.diff_versions("base", "edited");
+        std::vector<bool> in_diff(64 * 64 * 64);
+        for (const auto& brick : bricks)
+            in_diff[(brick.corner[2] / 2 * 64 + brick.corner[1] / 2) * 64 + brick.corner[0] / 2] = true;
+
+        versioned.rollback("edited");
+        std::vector<bool> edited(128 * 128 * 128);
+        for (uint32_t z = 0; z < 128; z++)
+            for (uint32_t y = 0; y < 128; y++)
+                for (uint32_t x = 0; x < 128; x++)
+                    edited[(z * 128 + y) * 128 + x] = versioned.get(x, y, z);
+
+        versioned.rollback("base");
+        std::vector<bool> brick_changed(64 * 64 * 64);
+        for (uint32_t z = 0; z < 128; z++) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    bool base = versioned.get(x, y, z);
+                    if (base != map.get(x, y, z)) {
+                        std::cout << "version error: base changed at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                    if (base != edited[(z * 128 + y) * 128 + x])
+                        brick_changed[(z / 2 * 64 + y / 2) * 64 + x / 2] = true;
+                }
+            }
+        }
+
+        if (in_diff != brick_changed) {
+            std::cout << "version error: diff does not match the changed bricks" << std::endl;
+        }
+        std::cout << "versions: " << bricks.size() << " bricks differ" << std::endl;
+
+        // A separate DAG with the same voxels, renumbered by compaction and
+        // read back from flattened words, must give the same diff
+        versioned.rollback("edited");
+        DAG copy(versioned.flatten(DAG_PAGE_SIZE), versioned.m_level_count);
+        versioned.rollback("base");
+
+        start = std::chrono::high_resolution_clock::now();
+        auto separate = diff(dag, 0, copy, 0);
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "diff: " << separate.size() << " bricks across DAGs, dt="
+                  << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+
+        auto serial = diff(dag, 0, copy, 0, UINT32_MAX, 1);
+        auto same = [](const std::vector<VoxelBox>& a, const std::vector<VoxelBox>& b) {
+            return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const VoxelBox& x, const VoxelBox& y) {
+                return std::equal(x.corner, x.corner + 3, y.corner) && x.size == y.size;
+            });
+        };
+        if (!same(separate, bricks) || !same(serial, bricks)) {
+            std::cout << "diff error: separate DAGs differ in other bricks" << std::endl;
+        }
+
+        for (uint32_t z = 0; z < 128; z += 7) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    if (copy.get(x, y, z) != edited[(z * 128 + y) * 128 + x]) {
+                        std::cout << "diff error: DAG read from words differs at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+
+        // Coarse boxes cover every brick
+        auto boxes = diff(dag, 0, copy, 0, 3);
+        for (const auto& brick : bricks) {
+            bool covered = std::any_of(boxes.begin(), boxes.end(), [&](const VoxelBox& box) {
+                return box.size == 16 && brick.corner[0] / 16 * 16 == box.corner[0]
+                    && brick.corner[1] / 16 * 16 == box.corner[1] && brick.corner[2] / 16 * 16 == box.corner[2];
+            });
+            if (!covered) {
+                std::cout << "diff error: brick " << brick.corner[0] << ", " << brick.corner[1] << ", "
+                          << brick.corner[2] << " is in no box" << std::endl;
+            }
+        }
+
+        if (!diff(dag, 0, DAG(dag.flatten(), dag.m_level_count), 0).empty()) {
+            std::cout << "diff error: a DAG differs from its own copy" << std::endl;
+        }
+
+        // Dropping the edited version leaves only the original nodes
+        versioned.drop_version("edited");
+        versioned.drop_version("base");
+        versioned.collect_garbage();
+        if (versioned.m_levels != dag.m_levels) {
+            std::cout << "version error: dropped versions were not reclaimed" << std::endl;
+        }
+    }
+
+    // Set operations must match combining every voxel, and combining a DAG with
+    // itself must not add nodes
+    {
+        DAG shapes(dag.m_level_count);
+        uint32_t box_min[3] = {0, 60, 0};
+        uint32_t box_max[3] = {128, 64, 100};
+        apply_brush(shapes, SphereBrush(40.0f, 70.0f, 80.0f, 35.0f), BrushOp::Union);
+        apply_brush(shapes, BoxBrush(box_min, box_max), BrushOp::Union);
+
+        const char* names[] = {"union", "intersection", "difference"};
+        for (auto op : {SetOp::Union, SetOp::Intersection, SetOp::Difference}) {
+            start = std::chrono::high_resolution_clock::now();
+            DAG result = combine(dag, shapes, op);
+            end = std::chrono::high_resolution_clock::now();
+
+            size_t nodes = 0;
+            for (const auto& level : result.m_levels)
+                nodes += level.size();
+            std::cout << names[static_cast<int>(op)] << ": " << nodes << " nodes, dt="
+                      << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+
+            for (uint32_t z = 0; z < 128; z++) {
+                for (uint32_t y = 0; y < 128; y++) {
+                    for (uint32_t x = 0; x < 128; x++) {
+                        bool in_a = dag.get(x, y, z);
+                        bool in_b = shapes.get(x, y, z);
+                        bool expected = op == SetOp::Union ? in_a || in_b
+                            : op == SetOp::Intersection    ? in_a && in_b
+                                                           : in_a && !in_b;
+                        if (result.get(x, y, z) != expected) {
+                            std::cout << names[static_cast<int>(op)] << " error at " << x << ", " << y << ", " << z << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+
+        DAG itself = combine(dag, dag, SetOp::Union);
+        size_t dag_nodes = 0;
+        size_t itself_nodes = 0;
+        for (uint32_t level = 1; level < dag.m_level_count; level++) {
+            dag_nodes += dag.m_levels[level].size();
+            itself_nodes += itself.m_levels[level].size();
+        }
+        // The result starts with an empty node on every level, which the DAG may lack
+        if (!diff(dag, 0, itself, 0).empty() || itself_nodes > dag_nodes + dag.m_level_count - 2) {
+            std::cout << "union error: combining a DAG with itself changed it" << std::endl;
+        }
+
+        if (combine(dag, dag, SetOp::Difference).m_levels[0][0].children != 0) {
+            std::cout << "difference error: a DAG minus itself is not empty" << std::endl;
+        }
+    }
+
+    // Readers must see every published row of voxels whole while the writer
+    // edits it, and once they are done only the reachable nodes may remain
+    {
+        ConcurrentDAG shared(dag);
+        DAG mirror = dag;
+
+        for (uint32_t x = 0; x < 128; x++) {
+            shared.set(x, 64, 64, false);
+            mirror.set(x, 64, 64, false);
+        }
+        shared.publish();
+
+        std::atomic<bool> writing = true;
+        std::atomic<uint32_t> reads = 0;
+        std::atomic<uint32_t> torn_reads = 0;
+        auto reader = [&] {
+            while (writing.load()) {
+                ConcurrentDAG::ReadGuard guard(shared);
+                bool first = guard.get(0, 64, 64);
+                for (uint32_t x = 1; x < 128; x++) {
+                    if (guard.get(x, 64, 64) != first) {
+                        torn_reads++;
+                        break;
+                    }
+                }
+                reads++;
+            }
+        };
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; i++)
+            readers.emplace_back(reader);
+
+        start = std::chrono::high_resolution_clock::now();
+        uint32_t seed = 7;
+        for (uint32_t round = 0; round < 200; round++) {
+            for (uint32_t x = 0; x < 128; x++) {
+                shared.set(x, 64, 64, round % 2 == 0);
+                mirror.set(x, 64, 64, round % 2 == 0);
+            }
+            for (int i = 0; i < 16; i++) {
+                seed = seed * 1664525 + 1013904223;
+                uint32_t x = (seed >> 8) % 128;
+                uint32_t y = (seed >> 15) % 128;
+                uint32_t z = (seed >> 22) % 128;
+                if (y == 64 && z == 64)
+                    continue;
+                shared.set(x, y, z, i % 2 == 0);
+                mirror.set(x, y, z, i % 2 == 0);
+            }
+            shared.publish();
+        }
+        end = std::chrono::high_resolution_clock::now();
+
+        writing = false;
+        for (auto& thread : readers)
+            thread.join();
+
+        if (torn_reads > 0) {
+            std::cout << "concurrent error: " << torn_reads << " of " << reads << " reads saw a partial edit" << std::endl;
+        }
+
+        shared.publish();
+        ConcurrentDAG::ReadGuard guard(shared);
+        for (uint32_t z = 0; z < 128; z++) {
+            for (uint32_t y = 0; y < 128; y++) {
+                for (uint32_t x = 0; x < 128; x++) {
+                    if (guard.get(x, y, z) != mirror.get(x, y, z)) {
+                        std::cout << "concurrent error at " << x << ", " << y << ", " << z << std::endl;
+                    }
+                }
+            }
+        }
+
+        std::vector<std::vector<uint32_t>> reachable(dag.m_level_count);
+        std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, guard.root()}};
+        while (!stack.empty()) {
+            auto [level, index] = stack.back();
+            stack.pop_back();
+            if (std::find(reachable[level].begin(), reachable[level].end(), index) != reachable[level].end())
+                continue;
+
+            reachable[level].push_back(index);
+            if (level + 2 < dag.m_level_count) {
+                for (uint32_t ptr : guard.node(level, index).ptr)
+                    stack.emplace_back(level + 1, ptr);
+            }
+        }
+
+        size_t reachable_count = 0;
+        for (const auto& level : reachable)
+            reachable_count += level.size();
+        if (shared.node_count() != reachable_count || shared.retired_count() != 0) {
+            std::cout << "concurrent error: " << shared.node_count() << " nodes kept, "
+                      << reachable_count << " reachable" << std::endl;
+        }
+
+        std::cout << "concurrent: " << reads << " reads, " << reachable_count << " nodes, dt="
+                  << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+    }
+
+    // Threads inserting the same nodes in different orders must agree on one
+    // index for each of them. Pointers are drawn from 4 values, so about half
+    // of the nodes are duplicates.
+    {
+        std::vector<DAGNode> nodes(1 << 17);
+        uint32_t seed = 11;
+        for (auto& node : nodes) {
+            for (auto& ptr : node.ptr) {
+                seed = seed * 1664525 + 1013904223;
+                ptr = seed >> 30;
+            }
+        }
+
+        NodeIndex index(2);
+
+        const unsigned thread_count = 8;
+        std::vector<std::vector<uint32_t>> results(thread_count, std::vector<uint32_t>(nodes.size()));
+        auto insert = [&](unsigned thread) {
+            for (size_t i = 0; i < nodes.size(); i++) {
+                size_t j = (i * 7 + thread * nodes.size() / thread_count) % nodes.size();
+                results[thread][j] = index.find_or_insert(1, nodes[j]);
+            }
+        };
+
+        start = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; i++)
+            threads.emplace_back(insert, i);
+        for (auto& thread : threads)
+            thread.join();
+        end = std::chrono::high_resolution_clock::now();
+
+        std::unordered_map<DAGNode, uint32_t, DAGNodeHash> expected;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            uint32_t result = results[0][i];
+            auto [it, inserted] = expected.emplace(nodes[i], result);
+
+            bool agreed = it->second == result && index.node(1, result) == nodes[i];
+            for (unsigned thread = 1; thread < thread_count; thread++)
+                agreed = agreed && results[thread][i] == result;
+            if (!agreed) {
+                std::cout << "node index error at node " << i << std::endl;
+            }
+        }
+
+        if (index.size(1) != expected.size()) {
+            std::cout << "node index error: " << index.size(1) << " nodes instead of " << expected.size() << std::endl;
+        }
+
+        std::cout << "node index: " << expected.size() << " of " << nodes.size() << " nodes unique, "
+                  << thread_count << " threads, dt="
+                  << std::chrono::duration_cast<std::chrono::microseconds>(end - start) << std::endl;
+    }
+
+    // Different nodes with equal hashes go to chained directories, also when
+    // the hash puts them in the last slot of every directory
+    for (auto hash : {+[](const DAGNode&) -> uint64_t { return 0xF000000000000000; },
+             +[](const DAGNode&) -> uint64_t { return 0xFFFFFFFFFFFFFFFF; }}) {
+        NodeIndex index(2, hash);
+
+        const unsigned thread_count = 4;
+        const uint32_t node_count = 100;
+        std::vector<std::vector<uint32_t>> results(thread_count, std::vector<uint32_t>(node_count));
+        auto insert = [&](unsigned thread) {
+            for (uint32_t i = 0; i < node_count; i++) {
+                uint32_t j = (i + thread * 31) % node_count;
+                DAGNode node;
+                node.ptr[0] = j;
+                results[thread][j] = index.find_or_insert(1, node);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < thread_count; i++)
+            threads.emplace_back(insert, i);
+        for (auto& thread : threads)
+            thread.join();
+
+        for (uint32_t i = 0; i < node_count; i++) {
+            bool agreed = index.node(1, results[0][i]).ptr[0] == i;
+            for (unsigned thread = 1; thread < thread_count; thread++)
+                agreed = agreed && results[thread][i] == results[0][i];
+            if (!agreed) {
+                std::cout << "node index error: colliding node " << i << std::endl;
+            }
+        }
+        if (index.size(1) != node_count) {
+            std::cout << "node index error: " << index.size(1) << " colliding nodes instead of " << node_count << std::endl;
+        }
+    }
+
+    if (argc > 1) {
+        if (!write_dag_file(argv[1], dag)) {
+            std::cout << "failed to write " << argv[1] << std::endl;
+            return 1;
+        }
+        std::cout << "wrote " << argv[1] << std::endl;
+
+        start = std::chrono::high_resolution_clock::now();
+        auto ao = bake_ambient_occlusion(dag);
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "ao: " << ao.keys.size() << " surface voxels, dt="
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(end - start) << std::endl;
+
+        std::string ao_path = std::string(argv[1]) + ".ao";
+        if (!ao.write(ao_path)) {
+            std::cout << "failed to write " << ao_path << std::endl;
+            return 1;
+        }
+        std::cout << "wrote " << ao_path << std::endl;
+    }
+
     return 0;
 }
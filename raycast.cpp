@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include "ao.h"
+#include "raycast.h"
+
+struct StackEntry {
+    uint32_t node;
+    uint32_t corner[3];
+};
+
+RayHit raycast(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir,
+    float lod_scale)
+{
+    uint32_t root_size = 1 << level_count;
+
+    // Mirror the ray so that it travels along +x, +y and +z. Children are then
+    // always visited in ascending order along each axis, and the real child
+    // index is the mirrored one XOR the mirror mask.
+    float o[3] = {origin.x, origin.y, origin.z};
+    float d[3] = {dir.x, dir.y, dir.z};
+    uint32_t mirror = 0;
+    for (int i = 0; i < 3; i++) {
+        if (d[i] < 0.0f) {
+            o[i] = static_cast<float>(root_size) - o[i];
+            d[i] = -d[i];
+            mirror |= 1 << i;
+        }
+    }
+
+    float inv_dir[3];
+    for (int i = 0; i < 3; i++)
+        inv_dir[i] = 1.0f / std::max(d[i], MIN_RAY_DIR);
+
+    float t = 0.0f;
+    int axis = 0;
+    for (int i = 0; i < 3; i++) {
+        float t0 = (0.0f - o[i]) * inv_dir[i];
+        if (t0 > t) {
+            t = t0;
+            axis = i;
+        }
+    }
+
+    StackEntry stack[MAX_LEVELS];
+    uint32_t level = 0;
+    uint32_t node = 0;
+    uint32_t corner[3] = {0, 0, 0};
+
+    RayHit result;
+    result.nodes_visited = 1;
+
+    while (true) {
+        result.steps++;
+
+        uint32_t size = root_size >> level;
+        uint32_t half = size >> 1;
+
+        float tc[3];
+        float t1[3];
+        for (int i = 0; i < 3; i++) {
+            tc[i] = (static_cast<float>(corner[i] + half) - o[i]) * inv_dir[i];
+            t1[i] = (static_cast<float>(corner[i] + size) - o[i]) * inv_dir[i];
+        }
+
+        if (t >= std::min(std::min(t1[0], t1[1]), t1[2])) {
+            if (level == 0)
+                return result;
+
+            level--;
+            node = stack[level].node;
+            std::copy_n(stack[level].corner, 3, corner);
+            continue;
+        }
+
+        uint32_t child = (tc[0] <= t) | ((tc[1] <= t) << 1) | ((tc[2] <= t) << 2);
+
+        float child_exit = INFINITY;
+        int exit_axis = 0;
+        for (int i = 0; i < 3; i++) {
+            float te = (child & (1 << i)) ? t1[i] : tc[i];
+            if (te < child_exit) {
+                child_exit = te;
+                exit_axis = i;
+            }
+        }
+
+        // Nodes below L-2 are the 2x2x2 leaf masks themselves
+        bool is_leaf = level == level_count - 1;
+        uint32_t mask = is_leaf ? node : nodes[node];
+        uint32_t real_child = child ^ mirror;
+
+        if (mask & (1 << real_child)) {
+            if (is_leaf || static_cast<float>(half) < lod_scale * t) {
+                result.hit = true;
+                result.distance = t;
+                float n[3] = {0.0f, 0.0f, 0.0f};
+                n[axis] = (mirror & (1 << axis)) ? 1.0f : -1.0f;
+                result.normal = Vec3(n[0], n[1], n[2]);
+                for (int i = 0; i < 3; i++) {
+                    uint32_t mirrored = corner[i] + ((child & (1 << i)) ? half : 0);
+                    result.voxel[i] = (mirror & (1 << i)) ? root_size - mirrored - half : mirrored;
+                }
+                return result;
+            }
+
+            stack[level].node = node;
+            std::copy_n(corner, 3, stack[level].corner);
+
+            node = nodes[node + 1 + std::popcount(mask & ((1u << real_child) - 1))];
+            for (int i = 0; i < 3; i++)
+                corner[i] += (child & (1 << i)) ? half : 0;
+            level++;
+            result.nodes_visited++;
+            continue;
+        }
+
+        t = child_exit;
+        axis = exit_axis;
+    }
+}
+
+bool raycast_any(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir)
+{
+    uint32_t root_size = 1 << level_count;
+
+    float o[3] = {origin.x, origin.y, origin.z};
+    float d[3] = {dir.x, dir.y, dir.z};
+    uint32_t mirror = 0;
+    for (int i = 0; i < 3; i++) {
+        if (d[i] < 0.0f) {
+            o[i] = static_cast<float>(root_size) - o[i];
+            d[i] = -d[i];
+            mirror |= 1 << i;
+        }
+    }
+
+    float inv_dir[3];
+    for (int i = 0; i < 3; i++)
+        inv_dir[i] = 1.0f / std::max(d[i], MIN_RAY_DIR);
+
+    // A popped node pushes up to 8 children, a net growth of 7 entries per
+    // level. A line crosses at most 4 of them, but the bound does not rely on
+    // the slab test being exact.
+    StackEntry stack[7 * MAX_LEVELS + 1];
+    uint32_t stack_level[7 * MAX_LEVELS + 1];
+    uint32_t top = 0;
+
+    float enter = 0.0f;
+    float exit = INFINITY;
+    for (int i = 0; i < 3; i++) {
+        enter = std::max(enter, (0.0f - o[i]) * inv_dir[i]);
+        exit = std::min(exit, (static_cast<float>(root_size) - o[i]) * inv_dir[i]);
+    }
+    if (enter >= exit)
+        return false;
+
+    stack[0] = {0, {0, 0, 0}};
+    stack_level[0] = 0;
+    top++;
+
+    while (top > 0) {
+        top--;
+        StackEntry entry = stack[top];
+        uint32_t level = stack_level[top];
+
+        uint32_t half = root_size >> (level + 1);
+        bool is_leaf = level == level_count - 1;
+        uint32_t mask = is_leaf ? entry.node : nodes[entry.node];
+
+        for (uint32_t child = 0; child < 8; child++) {
+            uint32_t real_child = child ^ mirror;
+            if ((mask & (1 << real_child)) == 0)
+                continue;
+
+            uint32_t corner[3];
+            float child_enter = 0.0f;
+            float child_exit = INFINITY;
+            for (int i = 0; i < 3; i++) {
+                corner[i] = entry.corner[i] + ((child & (1 << i)) ? half : 0);
+                child_enter = std::max(child_enter, (static_cast<float>(corner[i]) - o[i]) * inv_dir[i]);
+                child_exit = std::min(child_exit, (static_cast<float>(corner[i] + half) - o[i]) * inv_dir[i]);
+            }
+            if (child_enter >= child_exit)
+                continue;
+
+            if (is_leaf)
+                return true;
+
+            stack[top].node = nodes[entry.node + 1 + std::popcount(mask & ((1u << real_child) - 1))];
+            std::copy_n(corner, 3, stack[top].corner);
+            stack_level[top] = level + 1;
+            top++;
+        }
+    }
+
+    return false;
+}
+
+float fov_scale()
+{
+    return 2.0f * std::tan(FOV * 3.1415926f / 360.0f);
+}
+
+float lod_scale(float pixel_size, int height)
+{
+    return pixel_size * fov_scale() / static_cast<float>(height);
+}
+
+Vec3 primary_ray_dir(Vec3 look_dir, int x, int y, int width, int height)
+{
+    float u = static_cast<float>(x) / static_cast<float>(width);
+    float v = static_cast<float>(y) / static_cast<float>(height);
+
+    Vec3 U = normalize(cross(UP, -look_dir));
+    Vec3 V = normalize(cross(-look_dir, U));
+
+    U = (fov_scale() * static_cast<float>(width) / static_cast<float>(height)) * U;
+    V = fov_scale() * V;
+
+    return normalize(look_dir + (u - 0.5f) * U + (v - 0.5f) * V);
+}
+
+Vec3 heatmap_color(uint32_t count)
+{
+    float value = std::min(static_cast<float>(count) / static_cast<float>(HEATMAP_MAX_COUNT), 1.0f);
+
+    if (value < 0.5f)
+        return Vec3(0.0f, 2.0f * value, 1.0f - 2.0f * value);
+
+    return Vec3(2.0f * value - 1.0f, 2.0f - 2.0f * value, 0.0f);
+}
+
+float shade(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir,
+    const RayHit& hit, const AmbientOcclusion* ao, bool shadows)
+{
+    float ambient = 1.0f;
+    if (ao) {
+        uint32_t axis = hit.normal.x != 0.0f ? 0 : hit.normal.y != 0.0f ? 1 : 2;
+        bool positive = hit.normal.ptr()[axis] > 0.0f;
+        ambient = ao->lookup(hit.voxel[0], hit.voxel[1], hit.voxel[2], face_index(axis, positive));
+    }
+
+    static const Vec3 sun = normalize(SUN);
+    float direct = std::clamp(dot(hit.normal, sun), 0.0f, 1.0f);
+
+    if (shadows && direct > 0.0f) {
+        Vec3 point = origin + hit.distance * dir;
+        if (raycast_any(nodes, level_count, point + SHADOW_BIAS * hit.normal, sun))
+            direct = 0.0f;
+    }
+
+    return 0.3f * ambient + 0.7f * direct;
+}
+
+void render_reference(const std::vector<uint32_t>& nodes, uint32_t level_count,
+    Vec3 position, Vec3 look_dir, int width, int height, std::vector<float>& output,
+    DebugView view, float lod_pixel_size, const AmbientOcclusion* ao, bool shadows)
+{
+    float lod = lod_scale(lod_pixel_size, height);
+
+    output.resize(static_cast<size_t>(width) * height * 4);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Vec3 dir = primary_ray_dir(look_dir, x, y, width, height);
+            RayHit hit = raycast(nodes, level_count, position, dir, lod);
+
+            Vec3 color;
+            if (view == DebugView::Steps) {
+                color = heatmap_color(hit.steps);
+            } else if (view == DebugView::Nodes) {
+                color = heatmap_color(hit.nodes_visited);
+            } else if (hit.hit) {
+                float value = shade(nodes, level_count, position, dir, hit, ao, shadows);
+                color = Vec3(value, value, value);
+            }
+
+            float* pixel = &output[(static_cast<size_t>(y) * width + x) * 4];
+            pixel[0] = color.x;
+            pixel[1] = color.y;
+            pixel[2] = color.z;
+            pixel[3] = 1.0f;
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "linmath.h"
+
+struct AmbientOcclusion;
+
+// CPU port of the traversal in raytrace-dag.comp. Both walk the output of
+// DAG::flatten() with the same operations in the same order, so a frame
+// rendered here can be compared pixel by pixel with the compute shader.
+
+static constexpr uint32_t MAX_LEVELS = 16;
+static constexpr float MIN_RAY_DIR = 1e-7f;
+static constexpr Vec3 SUN = Vec3(0.3f, 0.5f, 0.7f);
+static constexpr float FOV = 90.0f; // Vertical, in degrees
+static constexpr uint32_t HEATMAP_MAX_COUNT = 128;
+static constexpr float SHADOW_BIAS = 1e-2f; // In voxels, along the normal
+
+// What the output image shows. The heatmaps color each pixel by how many
+// traversal loop iterations or node visits its ray took.
+enum class DebugView {
+    None,
+    Steps,
+    Nodes,
+};
+
+struct RayHit {
+    bool hit = false;
+    float distance = 0.0f;
+    Vec3 normal;
+    // Lowest corner of the voxel, or of the solid block for level of detail
+    // hits
+    uint32_t voxel[3] = {0, 0, 0};
+
+    uint32_t steps = 0;
+    uint32_t nodes_visited = 0;
+};
+
+// Children smaller than lod_scale * distance are taken as solid without
+// descending into them. 0 traverses down to single voxels.
+RayHit raycast(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir,
+    float lod_scale = 0.0f);
+
+// Whether anything solid lies along the ray. Children are visited in mirrored
+// index order without sorting them by distance, and the first occupied voxel
+// found ends the search, which is all a shadow ray needs.
+bool raycast_any(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir);
+
+// Height of the image plane at unit distance from the camera
+float fov_scale();
+
+// lod_scale for raycast() that stops at nodes smaller than pixel_size pixels
+// of an image `height` pixels high
+float lod_scale(float pixel_size, int height);
+
+Vec3 primary_ray_dir(Vec3 look_dir, int x, int y, int width, int height);
+
+// Blue to green to red ramp over [0, HEATMAP_MAX_COUNT]
+Vec3 heatmap_color(uint32_t count);
+
+// Lambert shading with an ambient term, scaled by baked ambient occlusion.
+// With shadows, the direct term is dropped when a ray from the hit towards the
+// sun is blocked.
+float shade(const std::vector<uint32_t>& nodes, uint32_t level_count, Vec3 origin, Vec3 dir,
+    const RayHit& hit, const AmbientOcclusion* ao, bool shadows);
+
+// Renders RGBA float pixels, bottom row first, like glGetTextureImage
+void render_reference(const std::vector<uint32_t>& nodes, uint32_t level_count,
+    Vec3 position, Vec3 look_dir, int width, int height, std::vector<float>& output,
+    DebugView view = DebugView::None, float lod_pixel_size = 0.0f, const AmbientOcclusion* ao = nullptr,
+    bool shadows = false);
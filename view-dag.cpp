@@ -1,14 +1,71 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <glad/gl.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include "ao.h"
+#include "dag.h"
 #include "linmath.h"
+#include "raycast.h"
 
 static constexpr size_t INFO_LOG_SIZE = 2048; // 2 kb
 static constexpr float PI = 3.1415926f;
 static constexpr float SENSITIVITY = 0.1f;
 static constexpr float MOVE_SPEED = 0.3f;
+static constexpr uint32_t LEVEL_COUNT = 7;
+static constexpr float FRAME_TIME_BUDGET_MS = 12.0f;
+static constexpr float MIN_RENDER_SCALE = 0.25f;
+static constexpr int GPU_TIMER_QUERY_COUNT = 3;
+static constexpr int UNIFORM_RING_SIZE = 3;
+static constexpr const char* PROGRAM_CACHE_DIRECTORY = "shader-cache";
+static constexpr const char* WORK_GROUP_TUNING_PATH = "shader-cache/work-group-size.txt";
+static constexpr int REFRESH_PERIOD = 16;
+static constexpr float MAX_HISTORY_AGE = 32.0f;
+static constexpr float REPROJECTION_TOLERANCE = 0.5f; // In pixels
+static constexpr int BEAM_TILE_SIZE = 8;
+static constexpr int BEAM_WORK_GROUP_SIZE = 8;
+static constexpr float BEAM_MARGIN = 1.0f; // In voxels
+static constexpr float BEAM_LOD_FACTOR = 2.0f;
+static constexpr int AUTOTUNE_WARMUP_DISPATCHES = 2;
+static constexpr int AUTOTUNE_TIMED_DISPATCHES = 9;
+static constexpr uint32_t STREAM_POOL_PAGES = 16384; // 256 MiB of DAG_PAGE_SIZE pages
+static constexpr int STREAM_UPLOADS_PER_FRAME = 32;
+static constexpr int VALIDATE_MAX_FRAMES = 1000;
+static constexpr float LOD_PIXEL_SIZE = 1.0f;
+static constexpr int PATH_BOUNCES = 3;
+static constexpr float ALBEDO = 0.8f;
+static constexpr float SUN_RADIANCE = 0.7f;
+static constexpr float SKY_RADIANCE = 0.375f;
+static constexpr uint32_t ACCUMULATE_MAX_SAMPLES = 4096;
+static constexpr int CAPTURE_BUFFER_COUNT = 3;
+static constexpr size_t CAPTURE_MAX_QUEUED = 8; // Encoded frames held in memory
+static constexpr const char* CAPTURE_PREFIX = "capture/frame";
+
+struct WorkGroupShape {
+    int x, y;
+    bool swizzle;
+};
+
+// Candidates for the autotuner, the first one is used until a result exists
+static constexpr WorkGroupShape WORK_GROUP_SHAPES[] = {
+    {16, 16, false},
+    {8, 8, false},
+    {16, 8, false},
+    {32, 4, false},
+    {8, 4, false},
+    {8, 8, true},
+    {8, 4, true},
+};
 
 template<typename ...Args>
 void panic(Args&& ...args)
@@ -33,6 +90,10 @@ struct GlobalState {
     Vec3 position;
     float pitch, yaw;
     double cursor_x, cursor_y;
+    DebugView debug_view = DebugView::None;
+    bool accumulate = false;
+    bool capture = false;
+    std::string capture_prefix = CAPTURE_PREFIX;
 } g_state;
 
 GLFWwindow* create_window(int width, int height, const char* title)
@@ -55,6 +116,49 @@ GLFWwindow* create_window(int width, int height, const char* title)
     return window;
 }
 
+using ShaderDefines = std::vector<std::pair<std::string, std::string>>;
+
+std::string glsl_float(float value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+
+    std::string result = text;
+    if (result.find_first_of(".e") == std::string::npos)
+        result += ".0";
+    return result;
+}
+
+std::string glsl_vec3(Vec3 value)
+{
+    return "vec3(" + glsl_float(value.x) + ", " + glsl_float(value.y) + ", " + glsl_float(value.z) + ")";
+}
+
+// Inserts the defines right after the #version directive. Values shared with
+// the C++ side are passed this way instead of being repeated in the shader, and
+// constants such as the level count let the driver unroll the traversal.
+std::string specialize_shader(const std::string& source, const ShaderDefines& defines)
+{
+    auto version = source.find("#version");
+    if (version == std::string::npos)
+        panic("shader has no #version directive");
+
+    auto line_end = source.find('\n', version);
+    if (line_end == std::string::npos)
+        line_end = source.size();
+
+    std::string result = source.substr(0, line_end) + "\n";
+    for (const auto& [name, value] : defines)
+        result += "#define " + name + " " + value + "\n";
+
+    // Keep line numbers in compile errors pointing into the original file
+    auto line = std::count(source.begin(), source.begin() + line_end, '\n') + 2;
+    result += "#line " + std::to_string(line) + "\n";
+    result += source.substr(std::min(line_end + 1, source.size()));
+
+    return result;
+}
+
 GLuint create_shader(const char* source, GLenum type)
 {
     GLuint shader = glCreateShader(type);
@@ -84,6 +188,7 @@ GLuint create_program(const char* vertex_src, const char* fragment_src)
     glAttachShader(program, vertex_shader);
     glAttachShader(program, fragment_shader);
 
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(program);
 
     GLint success = GL_FALSE;
@@ -110,6 +215,7 @@ GLuint create_compute_program(const char* compute_src)
 
     glAttachShader(program, compute_shader);
 
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(program);
 
     GLint success = GL_FALSE;
@@ -127,6 +233,168 @@ GLuint create_compute_program(const char* compute_src)
     return program;
 }
 
+std::string get_driver_string()
+{
+    return std::string(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "\n"
+        + reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "\n"
+        + reinterpret_cast<const char*>(glGetString(GL_VERSION));
+}
+
+uint64_t fnv1a(const std::string& data, uint64_t hash = 0xcbf29ce484222325)
+{
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Stores linked program binaries on disk so that subsequent launches can skip
+// shader compilation. Entries are keyed by a hash of the sources and the driver
+// identification; the driver string is also stored in the entry and compared
+// on load, and anything the driver refuses is rebuilt from source.
+class ProgramCache {
+public:
+    explicit ProgramCache(std::filesystem::path directory);
+
+    template<typename Build>
+    GLuint get(const std::vector<std::string>& sources, Build&& build);
+
+private:
+    GLuint load(const std::filesystem::path& path) const;
+    void store(const std::filesystem::path& path, GLuint program) const;
+
+    std::filesystem::path directory;
+    std::string driver;
+    bool supported = false;
+};
+
+static constexpr uint32_t PROGRAM_CACHE_MAGIC = 0x42505653; // "SVPB"
+
+ProgramCache::ProgramCache(std::filesystem::path directory)
+    : directory(std::move(directory))
+{
+    GLint format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    supported = format_count > 0;
+
+    driver = get_driver_string();
+
+    if (supported) {
+        std::error_code error;
+        std::filesystem::create_directories(this->directory, error);
+    }
+}
+
+template<typename Build>
+GLuint ProgramCache::get(const std::vector<std::string>& sources, Build&& build)
+{
+    if (!supported)
+        return build();
+
+    uint64_t hash = fnv1a(driver);
+    for (const auto& source : sources)
+        hash = fnv1a(source, hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+    auto path = directory / name;
+
+    if (GLuint program = load(path))
+        return program;
+
+    GLuint program = build();
+    store(path, program);
+
+    return program;
+}
+
+GLuint ProgramCache::load(const std::filesystem::path& path) const
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.good())
+        return 0;
+
+    uint32_t magic = 0;
+    uint32_t driver_size = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&driver_size), sizeof(driver_size));
+    if (!file.good() || magic != PROGRAM_CACHE_MAGIC || driver_size != driver.size())
+        return 0;
+
+    std::string stored_driver(driver_size, '\0');
+    file.read(stored_driver.data(), driver_size);
+    if (!file.good() || stored_driver != driver)
+        return 0;
+
+    GLenum format = 0;
+    uint32_t binary_size = 0;
+    file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    file.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+
+    // The binary is the rest of the file, so a corrupt size is caught before
+    // allocating for it
+    auto binary_start = file.tellg();
+    file.seekg(0, std::ios::end);
+    auto file_end = file.tellg();
+    file.seekg(binary_start);
+    if (!file.good() || binary_size == 0 || file_end - binary_start != binary_size)
+        return 0;
+
+    std::vector<char> binary(binary_size);
+    file.read(binary.data(), binary_size);
+    if (!file.good())
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+
+    GLint success = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (success != GL_TRUE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+void ProgramCache::store(const std::filesystem::path& path, GLuint program) const
+{
+    GLint binary_size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+    if (binary_size <= 0)
+        return;
+
+    GLenum format = 0;
+    std::vector<char> binary(binary_size);
+    glGetProgramBinary(program, binary_size, NULL, &format, binary.data());
+
+    // Write to a temporary file first so a crash never leaves a torn entry
+    auto temporary_path = path;
+    temporary_path += ".tmp";
+
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!file.good())
+            return;
+
+        uint32_t driver_size = static_cast<uint32_t>(driver.size());
+        uint32_t size = static_cast<uint32_t>(binary_size);
+        file.write(reinterpret_cast<const char*>(&PROGRAM_CACHE_MAGIC), sizeof(PROGRAM_CACHE_MAGIC));
+        file.write(reinterpret_cast<const char*>(&driver_size), sizeof(driver_size));
+        file.write(driver.data(), driver_size);
+        file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        file.write(binary.data(), binary_size);
+        if (!file.good())
+            return;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+}
+
 GLuint create_vertex_buffer_object()
 {
     float data[] = {
@@ -158,7 +426,17 @@ GLuint create_vertex_array_object(GLuint vbo)
     return vao;
 }
 
-GLuint create_texture(int width, int height)
+GLuint create_storage_buffer(const std::vector<uint32_t>& data, GLuint binding)
+{
+    GLuint buffer;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, data.size() * sizeof(uint32_t), data.data(), 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+
+    return buffer;
+}
+
+GLuint create_texture(int width, int height, GLenum internal_format, GLenum format)
 {
     GLuint texture;
     glGenTextures(1, &texture);
@@ -166,17 +444,758 @@ GLuint create_texture(int width, int height)
     glBindTexture(GL_TEXTURE_2D, texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
-    glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_FLOAT, NULL);
 
     return texture;
 }
 
+// Per-frame uniform buffer slots in persistently mapped memory. Each slot is
+// fenced after the commands reading it, and is only rewritten once the GPU has
+// passed that fence, so writing the next frame never waits on the current one.
+class UniformRing {
+public:
+    explicit UniformRing(size_t size);
+    ~UniformRing();
+
+    UniformRing(const UniformRing&) = delete;
+    UniformRing& operator=(const UniformRing&) = delete;
+
+    // Waits for the oldest slot to be free, binds it and returns it for writing
+    void* next(GLuint binding);
+    // Marks the current slot as in use by everything submitted so far
+    void fence();
+
+private:
+    GLuint buffer;
+    uint8_t* mapped;
+    size_t stride;
+    size_t size;
+    int current = 0;
+    GLsync fences[UNIFORM_RING_SIZE] = {};
+};
+
+UniformRing::UniformRing(size_t size)
+    : size(size)
+{
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    stride = (size + alignment - 1) / alignment * alignment;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, stride * UNIFORM_RING_SIZE, NULL, flags);
+    mapped = static_cast<uint8_t*>(glMapNamedBufferRange(buffer, 0, stride * UNIFORM_RING_SIZE, flags));
+    if (!mapped) {
+        panic("failed to map uniform buffer");
+    }
+}
+
+UniformRing::~UniformRing()
+{
+    for (auto fence : fences)
+        glDeleteSync(fence);
+
+    glUnmapNamedBuffer(buffer);
+    glDeleteBuffers(1, &buffer);
+}
+
+void* UniformRing::next(GLuint binding)
+{
+    current = (current + 1) % UNIFORM_RING_SIZE;
+
+    if (fences[current]) {
+        while (glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences[current]);
+        fences[current] = 0;
+    }
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, current * stride, size);
+    return mapped + current * stride;
+}
+
+void UniformRing::fence()
+{
+    if (fences[current])
+        glDeleteSync(fences[current]);
+
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Keeps a fixed size pool of pages of a DAG file on the GPU. The shader marks
+// every page a frame needs in a feedback buffer, which is copied into mapped
+// memory and scanned once its fence has passed. Missing pages are read from
+// disk by a background thread and replace the least recently used ones.
+class PageStreamer {
+public:
+    PageStreamer(const std::string& path, uint32_t pool_pages);
+    ~PageStreamer();
+
+    PageStreamer(const PageStreamer&) = delete;
+    PageStreamer& operator=(const PageStreamer&) = delete;
+
+    const DAGFileHeader& get_header() const { return header; }
+
+    // Requests pages missing in the last feedback and uploads loaded ones
+    void update();
+    // Queues a readback of the feedback of everything submitted so far
+    void read_feedback(uint32_t frame_index);
+    // The last feedback had no missing pages, and nothing changed since
+    bool is_idle() const { return idle; }
+
+private:
+    static constexpr uint32_t NO_PAGE = 0xFFFFFFFF;
+
+    void load_pages();
+    void scan_feedback();
+    void upload(uint32_t page, const std::vector<uint32_t>& data);
+
+    DAGFile file;
+    DAGFileHeader header;
+    uint32_t page_count;
+    uint32_t pool_pages;
+
+    GLuint pool_buffer;
+    GLuint page_table_buffer;
+    GLuint feedback_buffer;
+    GLuint readback_buffer;
+    const uint32_t* readback;
+    GLsync readback_fence = 0;
+    uint32_t readback_frame = 0;
+    uint32_t readback_uploads = 0;
+
+    // Slot of every page and page in every slot, the former mirrored on the GPU
+    std::vector<uint32_t> page_slots;
+    std::vector<uint32_t> slot_pages;
+    // Latest feedback value seen for each page
+    std::vector<uint32_t> last_used;
+    uint32_t latest_frame = 0;
+    std::vector<bool> requested;
+    size_t requested_count = 0;
+    uint32_t uploads = 0;
+    bool idle = false;
+
+    // Shared with the loader thread
+    std::thread loader;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<uint32_t> requests;
+    // Pages that failed to read come back without data
+    std::deque<std::pair<uint32_t, std::vector<uint32_t>>> loaded;
+    bool stopping = false;
+};
+
+PageStreamer::PageStreamer(const std::string& path, uint32_t pool_pages)
+    : file(path)
+{
+    if (!file.is_open()) {
+        panic("failed to open DAG file: ", path);
+    }
+
+    header = file.get_header();
+    page_count = header.page_count();
+    this->pool_pages = std::clamp(pool_pages, 1u, page_count);
+
+    page_slots.assign(page_count, NO_PAGE);
+    slot_pages.assign(this->pool_pages, NO_PAGE);
+    last_used.assign(page_count, 0);
+    requested.assign(page_count, false);
+
+    size_t table_size = page_count * sizeof(uint32_t);
+
+    glCreateBuffers(1, &pool_buffer);
+    glNamedBufferStorage(pool_buffer, static_cast<size_t>(this->pool_pages) * header.page_size * sizeof(uint32_t), NULL, GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &page_table_buffer);
+    glNamedBufferStorage(page_table_buffer, table_size, page_slots.data(), GL_DYNAMIC_STORAGE_BIT);
+    glCreateBuffers(1, &feedback_buffer);
+    glNamedBufferStorage(feedback_buffer, table_size, last_used.data(), 0);
+
+    GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glCreateBuffers(1, &readback_buffer);
+    glNamedBufferStorage(readback_buffer, table_size, NULL, flags);
+    readback = static_cast<const uint32_t*>(glMapNamedBufferRange(readback_buffer, 0, table_size, flags));
+    if (!readback) {
+        panic("failed to map page feedback buffer");
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pool_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, page_table_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, feedback_buffer);
+
+    // The root page is needed by every ray and never evicted
+    std::vector<uint32_t> data;
+    if (!file.read_page(0, data)) {
+        panic("failed to read DAG file: ", path);
+    }
+    upload(0, data);
+
+    loader = std::thread(&PageStreamer::load_pages, this);
+}
+
+PageStreamer::~PageStreamer()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    loader.join();
+
+    glDeleteSync(readback_fence);
+    glUnmapNamedBuffer(readback_buffer);
+    glDeleteBuffers(1, &readback_buffer);
+    glDeleteBuffers(1, &feedback_buffer);
+    glDeleteBuffers(1, &page_table_buffer);
+    glDeleteBuffers(1, &pool_buffer);
+}
+
+void PageStreamer::load_pages()
+{
+    while (true) {
+        uint32_t page;
+        {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [&] { return stopping || !requests.empty(); });
+            if (stopping)
+                return;
+
+            page = requests.front();
+            requests.pop_front();
+        }
+
+        // panic() exits, which must not happen while the main thread renders
+        std::vector<uint32_t> data;
+        if (!file.read_page(page, data))
+            data.clear();
+
+        std::lock_guard lock(mutex);
+        loaded.emplace_back(page, std::move(data));
+    }
+}
+
+void PageStreamer::update()
+{
+    if (readback_fence) {
+        GLenum status = glClientWaitSync(readback_fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(readback_fence);
+            readback_fence = 0;
+            scan_feedback();
+        }
+    }
+
+    std::vector<std::pair<uint32_t, std::vector<uint32_t>>> ready;
+    {
+        std::lock_guard lock(mutex);
+        while (!loaded.empty() && ready.size() < STREAM_UPLOADS_PER_FRAME) {
+            ready.push_back(std::move(loaded.front()));
+            loaded.pop_front();
+        }
+    }
+
+    for (const auto& [page, data] : ready) {
+        if (data.empty()) {
+            panic("failed to read DAG page ", page);
+        }
+        upload(page, data);
+    }
+}
+
+void PageStreamer::scan_feedback()
+{
+    latest_frame = std::max(latest_frame, readback_frame);
+
+    // Pages are requested in address order, which puts the upper levels of the
+    // DAG first since DAG::flatten() writes the levels in order
+    std::vector<uint32_t> missing;
+    for (uint32_t page = 0; page < page_count; page++) {
+        uint32_t used = readback[page];
+        last_used[page] = std::max(last_used[page], used);
+
+        if (used == readback_frame && page_slots[page] == NO_PAGE && !requested[page]) {
+            requested[page] = true;
+            missing.push_back(page);
+        }
+    }
+
+    if (!missing.empty()) {
+        std::lock_guard lock(mutex);
+        requests.insert(requests.end(), missing.begin(), missing.end());
+    }
+    wake.notify_one();
+
+    requested_count += missing.size();
+    idle = requested_count == 0 && readback_uploads == uploads;
+}
+
+void PageStreamer::upload(uint32_t page, const std::vector<uint32_t>& data)
+{
+    if (requested[page]) {
+        requested[page] = false;
+        requested_count--;
+    }
+
+    // Take a free slot, or else the one whose page was needed longest ago.
+    // Pages the latest feedback still asked for are kept, the load is dropped
+    // and requested again if it is still missing then.
+    uint32_t slot = NO_PAGE;
+    for (uint32_t i = 0; i < pool_pages && slot == NO_PAGE; i++) {
+        if (slot_pages[i] == NO_PAGE)
+            slot = i;
+    }
+
+    if (slot == NO_PAGE) {
+        uint32_t oldest = latest_frame;
+        for (uint32_t i = 0; i < pool_pages; i++) {
+            uint32_t resident = slot_pages[i];
+            if (resident != 0 && last_used[resident] < oldest) {
+                oldest = last_used[resident];
+                slot = i;
+            }
+        }
+    }
+
+    if (slot == NO_PAGE)
+        return;
+
+    if (slot_pages[slot] != NO_PAGE) {
+        uint32_t evicted = slot_pages[slot];
+        page_slots[evicted] = NO_PAGE;
+        glNamedBufferSubData(page_table_buffer, evicted * sizeof(uint32_t), sizeof(uint32_t), &page_slots[evicted]);
+    }
+
+    size_t page_bytes = header.page_size * sizeof(uint32_t);
+    glNamedBufferSubData(pool_buffer, slot * page_bytes, page_bytes, data.data());
+
+    slot_pages[slot] = page;
+    page_slots[page] = slot;
+    glNamedBufferSubData(page_table_buffer, page * sizeof(uint32_t), sizeof(uint32_t), &page_slots[page]);
+
+    uploads++;
+    idle = false;
+}
+
+void PageStreamer::read_feedback(uint32_t frame_index)
+{
+    // One readback in flight at a time, frames in between go unobserved
+    if (readback_fence)
+        return;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glCopyNamedBufferSubData(feedback_buffer, readback_buffer, 0, 0, page_count * sizeof(uint32_t));
+    readback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback_frame = frame_index + 1;
+    readback_uploads = uploads;
+}
+
+// Reads frames back through a ring of pixel pack buffers. Each copy is fenced
+// and only mapped once the GPU has passed the fence, a few frames later, and a
+// background thread writes the pixels out as numbered PPM images. Frames are
+// linear and shown through an sRGB framebuffer, so they are read back at 16
+// bits and the encoder applies the same sRGB curve.
+class FrameCapture {
+public:
+    explicit FrameCapture(const std::string& prefix);
+    // Waits for every queued frame to be written
+    ~FrameCapture();
+
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    const std::string& get_prefix() const { return prefix; }
+
+    // Queues a copy of the bottom left width x height texels of the texture
+    void capture(GLuint texture, int width, int height);
+    // Hands finished copies to the encoder thread, and panics if it failed to
+    // write one
+    void update();
+
+private:
+    struct Readback {
+        GLuint buffer = 0;
+        const uint8_t* mapped = nullptr;
+        size_t capacity = 0;
+        GLsync fence = 0;
+        int width = 0;
+        int height = 0;
+        uint32_t index = 0;
+    };
+
+    // Linear 16 bit RGB, top row first
+    struct Image {
+        uint32_t index;
+        int width;
+        int height;
+        std::vector<uint16_t> pixels;
+    };
+
+    void encode_images();
+    void retire(Readback& readback);
+
+    std::string prefix;
+    Readback readbacks[CAPTURE_BUFFER_COUNT];
+    int current = 0;
+    uint32_t next_index = 0;
+
+    // Shared with the encoder thread
+    std::thread encoder;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::deque<Image> images;
+    bool stopping = false;
+    std::string failed_path;
+};
+
+FrameCapture::FrameCapture(const std::string& prefix)
+    : prefix(prefix)
+{
+    auto directory = std::filesystem::path(prefix).parent_path();
+    if (!directory.empty())
+        std::filesystem::create_directories(directory);
+
+    encoder = std::thread(&FrameCapture::encode_images, this);
+}
+
+FrameCapture::~FrameCapture()
+{
+    for (int i = 1; i <= CAPTURE_BUFFER_COUNT; i++) {
+        auto& readback = readbacks[(current + i) % CAPTURE_BUFFER_COUNT];
+        if (readback.fence)
+            retire(readback);
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    encoder.join();
+
+    for (auto& readback : readbacks) {
+        if (readback.buffer) {
+            glUnmapNamedBuffer(readback.buffer);
+            glDeleteBuffers(1, &readback.buffer);
+        }
+    }
+}
+
+void FrameCapture::capture(GLuint texture, int width, int height)
+{
+    current = (current + 1) % CAPTURE_BUFFER_COUNT;
+    auto& readback = readbacks[current];
+
+    // Only waits when the GPU is CAPTURE_BUFFER_COUNT frames behind
+    if (readback.fence)
+        retire(readback);
+
+    size_t size = static_cast<size_t>(width) * height * 3 * sizeof(uint16_t);
+    if (size > readback.capacity) {
+        if (readback.buffer) {
+            glUnmapNamedBuffer(readback.buffer);
+            glDeleteBuffers(1, &readback.buffer);
+        }
+
+        GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &readback.buffer);
+        glNamedBufferStorage(readback.buffer, size, NULL, flags);
+        readback.mapped = static_cast<const uint8_t*>(glMapNamedBufferRange(readback.buffer, 0, size, flags));
+        if (!readback.mapped) {
+            panic("failed to map capture buffer");
+        }
+        readback.capacity = size;
+    }
+
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    glGetTextureSubImage(texture, 0, 0, 0, 0, width, height, 1, GL_RGB, GL_UNSIGNED_SHORT,
+        static_cast<GLsizei>(size), NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.width = width;
+    readback.height = height;
+    readback.index = next_index++;
+}
+
+void FrameCapture::update()
+{
+    {
+        std::lock_guard lock(mutex);
+        if (!failed_path.empty()) {
+            panic("failed to write frame: ", failed_path);
+        }
+    }
+
+    for (auto& readback : readbacks) {
+        if (!readback.fence)
+            continue;
+
+        GLenum status = glClientWaitSync(readback.fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+            retire(readback);
+    }
+}
+
+void FrameCapture::retire(Readback& readback)
+{
+    while (glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(readback.fence);
+    readback.fence = 0;
+
+    // Textures are stored bottom row first, images top row first
+    Image image{readback.index, readback.width, readback.height, {}};
+    size_t row = static_cast<size_t>(image.width) * 3;
+    const auto* mapped = reinterpret_cast<const uint16_t*>(readback.mapped);
+    image.pixels.resize(row * image.height);
+    for (int y = 0; y < image.height; y++)
+        std::copy_n(mapped + (image.height - 1 - y) * row, row, image.pixels.data() + y * row);
+
+    // Falls behind only when the disk can't keep up, rendering then slows down
+    // to the encoder instead of filling up memory
+    std::unique_lock lock(mutex);
+    drained.wait(lock, [&] { return images.size() < CAPTURE_MAX_QUEUED; });
+    images.push_back(std::move(image));
+    lock.unlock();
+    wake.notify_one();
+}
+
+void FrameCapture::encode_images()
+{
+    std::vector<uint8_t> srgb(65536);
+    for (size_t i = 0; i < srgb.size(); i++) {
+        float linear = static_cast<float>(i) / 65535.0f;
+        float encoded = linear <= 0.0031308f ? 12.92f * linear : 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+        srgb[i] = static_cast<uint8_t>(std::lround(std::clamp(encoded, 0.0f, 1.0f) * 255.0f));
+    }
+
+    std::vector<uint8_t> pixels;
+    while (true) {
+        Image image;
+        {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [&] { return stopping || !images.empty(); });
+            if (images.empty())
+                return;
+
+            image = std::move(images.front());
+            images.pop_front();
+        }
+        drained.notify_one();
+
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "-%05u.ppm", image.index);
+        std::string path = prefix + suffix;
+
+        pixels.resize(image.pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            pixels[i] = srgb[image.pixels[i]];
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << "P6\n"
+             << image.width << " " << image.height << "\n255\n";
+        file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+
+        // panic() exits, which must not happen while the main thread renders
+        if (!file.good()) {
+            std::lock_guard lock(mutex);
+            if (failed_path.empty())
+                failed_path = path;
+        }
+    }
+}
+
+// Measures GPU time of a section without stalling: results are read back a
+// few frames later from a small ring of queries.
+class GpuTimer {
+public:
+    GpuTimer();
+    ~GpuTimer();
+
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator=(const GpuTimer&) = delete;
+
+    void begin();
+    void end();
+    bool poll(float& milliseconds);
+
+private:
+    GLuint queries[GPU_TIMER_QUERY_COUNT];
+    int next = 0;
+    int pending = 0;
+};
+
+GpuTimer::GpuTimer()
+{
+    glCreateQueries(GL_TIME_ELAPSED, GPU_TIMER_QUERY_COUNT, queries);
+}
+
+GpuTimer::~GpuTimer()
+{
+    glDeleteQueries(GPU_TIMER_QUERY_COUNT, queries);
+}
+
+void GpuTimer::begin()
+{
+    // Drop the oldest result rather than wait for it
+    if (pending == GPU_TIMER_QUERY_COUNT)
+        pending--;
+
+    glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+}
+
+void GpuTimer::end()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    next = (next + 1) % GPU_TIMER_QUERY_COUNT;
+    pending++;
+}
+
+bool GpuTimer::poll(float& milliseconds)
+{
+    if (pending == 0)
+        return false;
+
+    GLuint oldest = queries[(next + GPU_TIMER_QUERY_COUNT - pending) % GPU_TIMER_QUERY_COUNT];
+
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(oldest, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available != GL_TRUE)
+        return false;
+
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(oldest, GL_QUERY_RESULT, &nanoseconds);
+    milliseconds = static_cast<float>(nanoseconds) / 1e6f;
+    pending--;
+
+    return true;
+}
+
+// Picks the fraction of the framebuffer resolution to trace at. Tracing cost
+// is roughly proportional to the pixel count, so the scale is corrected by the
+// square root of the budget to measured time ratio.
+class RenderScaleController {
+public:
+    explicit RenderScaleController(float budget_ms)
+        : budget_ms(budget_ms)
+    {
+    }
+
+    void update(float frame_ms);
+    float get_scale() const { return scale; }
+
+private:
+    float budget_ms;
+    float scale = 1.0f;
+    float smoothed_ms = 0.0f;
+};
+
+void RenderScaleController::update(float frame_ms)
+{
+    smoothed_ms = smoothed_ms == 0.0f ? frame_ms : 0.9f * smoothed_ms + 0.1f * frame_ms;
+
+    float target = scale * std::sqrt(budget_ms / std::max(smoothed_ms, 0.01f));
+    target = std::clamp(target, MIN_RENDER_SCALE, 1.0f);
+
+    // Ignore small corrections so the resolution doesn't flicker
+    if (std::abs(target - scale) > 0.05f * scale) {
+        scale = target;
+        smoothed_ms = 0.0f;
+    }
+}
+
+// The autotuner keeps one line per device: driver string hash, work group
+// width and height, and whether the swizzled thread order is used
+bool load_work_group_shape(WorkGroupShape& shape)
+{
+    auto driver_hash = fnv1a(get_driver_string());
+
+    std::ifstream file(WORK_GROUP_TUNING_PATH);
+    uint64_t hash;
+    WorkGroupShape entry;
+    while (file >> std::hex >> hash >> std::dec >> entry.x >> entry.y >> entry.swizzle) {
+        if (hash != driver_hash)
+            continue;
+
+        // Anything but a candidate the autotuner could have picked is a
+        // damaged entry, which is tuned again
+        for (auto candidate : WORK_GROUP_SHAPES) {
+            if (entry.x == candidate.x && entry.y == candidate.y && entry.swizzle == candidate.swizzle) {
+                shape = entry;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void save_work_group_shape(WorkGroupShape shape)
+{
+    auto driver_hash = fnv1a(get_driver_string());
+
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(WORK_GROUP_TUNING_PATH);
+        std::string line;
+        while (std::getline(file, line)) {
+            uint64_t hash = 0;
+            if (sscanf(line.c_str(), "%llx", reinterpret_cast<unsigned long long*>(&hash)) == 1 && hash != driver_hash)
+                lines.push_back(line);
+        }
+    }
+
+    char line[64];
+    snprintf(line, sizeof(line), "%016llx %d %d %d",
+        static_cast<unsigned long long>(driver_hash), shape.x, shape.y, shape.swizzle ? 1 : 0);
+    lines.push_back(line);
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(WORK_GROUP_TUNING_PATH).parent_path(), error);
+
+    std::ofstream file(WORK_GROUP_TUNING_PATH, std::ios::trunc);
+    for (const auto& entry : lines)
+        file << entry << "\n";
+}
+
+// std140 layout of the FrameUniforms block in raytrace-dag.comp
+struct FrameUniforms {
+    Vec3 position;
+    float pad0;
+    Vec3 look_dir;
+    float pad1;
+    Vec3 prev_position;
+    float pad2;
+    Vec3 prev_look_dir;
+    float pad3;
+    int32_t resolution[2];
+    uint32_t frame_index;
+    uint32_t history_valid;
+    uint32_t sample_index;
+};
+
+enum class RaytracePass {
+    Main,
+    BeamPrepass,
+    Accumulate,
+};
+
+struct TraversalStats {
+    uint32_t rays;
+    uint32_t steps;
+    uint32_t nodes_visited;
+};
+
 class Renderer {
 public:
-    Renderer();
+    explicit Renderer(const DAG& dag);
+    // Streams the DAG from a file written by write_dag_file(), keeping at most
+    // pool_pages of it on the GPU
+    Renderer(const std::string& stream_path, uint32_t pool_pages);
     ~Renderer();
 
     Renderer(const Renderer&) = delete;
@@ -184,70 +1203,557 @@ public:
 
     void render();
     GLFWwindow* get_window() const { return window; }
-
-    void set_uniform(GLint location, Vec3 value);
+    uint32_t get_level_count() const { return level_count; }
+    // Whether every page the current view needs is resident
+    bool is_fully_streamed() const { return !streamer || streamer->is_idle(); }
+
+    void set_camera(Vec3 position, Vec3 look_dir);
+    void set_dynamic_scale(bool enabled) { dynamic_scale = enabled; }
+    void set_reprojection(bool enabled) { reprojection = enabled; }
+    void set_debug_view(DebugView view);
+    // Subtrees smaller than this many pixels are drawn as solid, 0 disables
+    void set_lod_pixel_size(float pixel_size);
+    float get_lod_pixel_size() const { return lod_pixel_size; }
+    void set_ambient_occlusion(const AmbientOcclusion& ao);
+    void set_shadows(bool enabled);
+    bool has_shadows() const { return shadows; }
+    // Path traces more samples into an accumulation buffer while the camera is
+    // still, and starts over when it moves
+    void set_accumulation(bool enabled);
+    // Writes every presented frame to <prefix>-NNNNN.ppm at the traced
+    // resolution, an empty prefix stops. Numbering continues while the prefix
+    // stays the same.
+    void set_capture(const std::string& prefix);
+
+    // Totals of the last frame, only collected while a debug view is active
+    bool read_traversal_stats(TraversalStats& stats) const;
+    void read_frame(std::vector<float>& output, int& width, int& height) const;
+
+    // Times every candidate work group shape on the given view and keeps the
+    // fastest one, also for later launches on the same device
+    void autotune(Vec3 position, Vec3 look_dir);
+    bool has_tuned_work_group() const { return tuned_work_group; }
 
 private:
+    void init();
+    void create_raytrace_programs();
+    void rebuild_programs();
+    void resize_frame(int width, int height);
+    GLuint build_raytrace_program(WorkGroupShape shape, RaytracePass pass);
+    void write_uniforms();
+    void dispatch_raytrace(GLuint program, WorkGroupShape shape);
+    void dispatch_accumulate();
+
     GLFWwindow* window;
     GLuint fullscreen_program;
     GLuint raytrace_program;
-    GLuint frame;
+    GLuint beam_program;
+    GLuint accumulate_program = 0;
+    GLuint dag_buffer = 0;
+    GLuint stats_buffer;
+    GLuint ao_buffers[2] = {0, 0};
+    std::unique_ptr<UniformRing> uniform_ring;
+    std::unique_ptr<PageStreamer> streamer;
+    std::unique_ptr<FrameCapture> capture;
+    bool capturing = false;
     GLuint vao;
     GLuint vbo;
+
+    std::unique_ptr<ProgramCache> program_cache;
+    std::string raytrace_source;
+    uint32_t level_count;
+    WorkGroupShape work_group = WORK_GROUP_SHAPES[0];
+    bool tuned_work_group = false;
+    DebugView debug_view = DebugView::None;
+    float lod_pixel_size = LOD_PIXEL_SIZE;
+    bool shadows = true;
+
+    // Ping-pong pairs of color and (hit distance, age) images. Index `history`
+    // holds the last completed frame, the other one is traced into.
+    GLuint frames[2] = {0, 0};
+    GLuint depths[2] = {0, 0};
+    int history = 0;
+
+    // Start distance for each BEAM_TILE_SIZE^2 pixel tile
+    GLuint beam = 0;
+
+    // Sum and count of the path traced samples of each pixel, valid for
+    // sample_count samples from the camera of the previous frame
+    GLuint accumulation = 0;
+    bool accumulate = false;
+    uint32_t sample_count = 0;
+    Vec3 last_position;
+    Vec3 last_look_dir;
+
+    int frame_width = 0;
+    int frame_height = 0;
+    int render_width = 0;
+    int render_height = 0;
+
+    Vec3 camera_position;
+    Vec3 camera_look_dir;
+    Vec3 history_position;
+    Vec3 history_look_dir;
+    uint32_t frame_index = 0;
+    bool reprojection = true;
+    bool history_valid = false;
+
+    bool dynamic_scale = true;
+    RenderScaleController scale_controller{FRAME_TIME_BUDGET_MS};
+    std::unique_ptr<GpuTimer> trace_timer;
 };
 
-Renderer::Renderer()
+Renderer::Renderer(const DAG& dag)
+{
+    init();
+    level_count = dag.m_level_count;
+    dag_buffer = create_storage_buffer(dag.flatten(), 0);
+    create_raytrace_programs();
+}
+
+Renderer::Renderer(const std::string& stream_path, uint32_t pool_pages)
+{
+    init();
+    streamer = std::make_unique<PageStreamer>(stream_path, pool_pages);
+    level_count = streamer->get_header().level_count;
+    create_raytrace_programs();
+}
+
+void Renderer::init()
 {
     auto frag_source = read_text("../fullscreen.frag");
     auto vert_source = read_text("../fullscreen.vert");
-    auto comp_source = read_text("../raytrace-dag.comp");
+    raytrace_source = read_text("../raytrace-dag.comp");
 
     window = create_window(1280, 720, "view-dag");
-    fullscreen_program = create_program(vert_source.c_str(), frag_source.c_str());
-    raytrace_program = create_compute_program(comp_source.c_str());
-    frame = create_texture(1280, 720);
+
+    program_cache = std::make_unique<ProgramCache>(PROGRAM_CACHE_DIRECTORY);
+    fullscreen_program = program_cache->get({vert_source, frag_source}, [&] {
+        return create_program(vert_source.c_str(), frag_source.c_str());
+    });
+
+    stats_buffer = create_storage_buffer(std::vector<uint32_t>(sizeof(TraversalStats) / sizeof(uint32_t)), 1);
     vbo = create_vertex_buffer_object();
     vao = create_vertex_array_object(vbo);
+    trace_timer = std::make_unique<GpuTimer>();
+    uniform_ring = std::make_unique<UniformRing>(sizeof(FrameUniforms));
+}
+
+void Renderer::create_raytrace_programs()
+{
+    tuned_work_group = load_work_group_shape(work_group);
+    raytrace_program = build_raytrace_program(work_group, RaytracePass::Main);
+    beam_program = build_raytrace_program({BEAM_WORK_GROUP_SIZE, BEAM_WORK_GROUP_SIZE, false}, RaytracePass::BeamPrepass);
+}
+
+// Called when a setting baked into the shader changes
+void Renderer::rebuild_programs()
+{
+    glDeleteProgram(raytrace_program);
+    raytrace_program = build_raytrace_program(work_group, RaytracePass::Main);
+    glDeleteProgram(beam_program);
+    beam_program = build_raytrace_program({BEAM_WORK_GROUP_SIZE, BEAM_WORK_GROUP_SIZE, false}, RaytracePass::BeamPrepass);
+
+    // Built on first use
+    glDeleteProgram(accumulate_program);
+    accumulate_program = 0;
+
+    history_valid = false;
+    sample_count = 0;
 }
 
 Renderer::~Renderer()
 {
+    capture.reset();
+    trace_timer.reset();
+    uniform_ring.reset();
+    streamer.reset();
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
-    glDeleteTextures(1, &frame);
+    glDeleteTextures(2, frames);
+    glDeleteTextures(2, depths);
+    glDeleteTextures(1, &beam);
+    glDeleteTextures(1, &accumulation);
+    glDeleteBuffers(1, &stats_buffer);
+    glDeleteBuffers(2, ao_buffers);
+    glDeleteBuffers(1, &dag_buffer);
+    glDeleteProgram(accumulate_program);
+    glDeleteProgram(beam_program);
     glDeleteProgram(raytrace_program);
     glDeleteProgram(fullscreen_program);
     glfwDestroyWindow(window);
 }
 
+GLuint Renderer::build_raytrace_program(WorkGroupShape shape, RaytracePass pass)
+{
+    auto source = specialize_shader(raytrace_source, {
+        {"LEVEL_COUNT", std::to_string(level_count) + "u"},
+        {"WORK_GROUP_SIZE_X", std::to_string(shape.x)},
+        {"WORK_GROUP_SIZE_Y", std::to_string(shape.y)},
+        {"WORK_GROUP_SWIZZLE", shape.swizzle ? "1" : "0"},
+        {"FOV_SCALE", glsl_float(fov_scale())},
+        {"MIN_RAY_DIR", glsl_float(MIN_RAY_DIR)},
+        {"SUN", glsl_vec3(normalize(SUN))},
+        {"REFRESH_PERIOD", std::to_string(REFRESH_PERIOD) + "u"},
+        {"MAX_HISTORY_AGE", glsl_float(MAX_HISTORY_AGE)},
+        {"REPROJECTION_TOLERANCE", glsl_float(REPROJECTION_TOLERANCE)},
+        {"BEAM_PREPASS", pass == RaytracePass::BeamPrepass ? "1" : "0"},
+        {"BEAM_TILE_SIZE", std::to_string(BEAM_TILE_SIZE)},
+        {"BEAM_MARGIN", glsl_float(BEAM_MARGIN)},
+        {"BEAM_LOD_FACTOR", glsl_float(BEAM_LOD_FACTOR)},
+        {"DEBUG_VIEW", std::to_string(static_cast<int>(debug_view))},
+        {"HEATMAP_MAX_COUNT", std::to_string(HEATMAP_MAX_COUNT) + "u"},
+        {"STREAMING", streamer ? "1" : "0"},
+        {"PAGE_SIZE", std::to_string(streamer ? streamer->get_header().page_size : 1) + "u"},
+        {"LOD_PIXEL_SIZE", glsl_float(lod_pixel_size)},
+        {"AMBIENT_OCCLUSION", ao_buffers[0] ? "1" : "0"},
+        {"AO_FACE_BITS", std::to_string(AO_FACE_BITS) + "u"},
+        {"AO_FACE_MAX", std::to_string(AO_FACE_MAX) + "u"},
+        {"SHADOWS", shadows ? "1" : "0"},
+        {"SHADOW_BIAS", glsl_float(SHADOW_BIAS)},
+        {"ACCUMULATE", pass == RaytracePass::Accumulate ? "1" : "0"},
+        {"PATH_BOUNCES", std::to_string(PATH_BOUNCES)},
+        {"ALBEDO", glsl_float(ALBEDO)},
+        {"SUN_RADIANCE", glsl_float(SUN_RADIANCE)},
+        {"SKY_RADIANCE", glsl_float(SKY_RADIANCE)},
+    });
+
+    return program_cache->get({source}, [&] {
+        return create_compute_program(source.c_str());
+    });
+}
+
+void Renderer::write_uniforms()
+{
+    auto* uniforms = static_cast<FrameUniforms*>(uniform_ring->next(0));
+    uniforms->position = camera_position;
+    uniforms->look_dir = camera_look_dir;
+    uniforms->prev_position = history_position;
+    uniforms->prev_look_dir = history_look_dir;
+    uniforms->resolution[0] = render_width;
+    uniforms->resolution[1] = render_height;
+    uniforms->frame_index = frame_index;
+    uniforms->history_valid = reprojection && history_valid;
+    uniforms->sample_index = sample_count;
+}
+
+void Renderer::dispatch_raytrace(GLuint program, WorkGroupShape shape)
+{
+    int target = 1 - history;
+    int tiles_x = (render_width + BEAM_TILE_SIZE - 1) / BEAM_TILE_SIZE;
+    int tiles_y = (render_height + BEAM_TILE_SIZE - 1) / BEAM_TILE_SIZE;
+
+    write_uniforms();
+
+    glUseProgram(beam_program);
+    glBindImageTexture(4, beam, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glDispatchCompute(
+        (tiles_x + BEAM_WORK_GROUP_SIZE - 1) / BEAM_WORK_GROUP_SIZE,
+        (tiles_y + BEAM_WORK_GROUP_SIZE - 1) / BEAM_WORK_GROUP_SIZE,
+        1);
+
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    glUseProgram(program);
+
+    glBindImageTexture(0, frames[target], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(1, depths[target], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+    glBindImageTexture(2, frames[history], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(3, depths[history], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RG32F);
+    glBindImageTexture(4, beam, 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+    glDispatchCompute(
+        (render_width + shape.x - 1) / shape.x,
+        (render_height + shape.y - 1) / shape.y,
+        1);
+
+    uniform_ring->fence();
+}
+
+void Renderer::dispatch_accumulate()
+{
+    if (!accumulate_program)
+        accumulate_program = build_raytrace_program(work_group, RaytracePass::Accumulate);
+
+    int target = 1 - history;
+
+    write_uniforms();
+
+    glUseProgram(accumulate_program);
+    glBindImageTexture(0, frames[target], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(1, depths[target], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+    glBindImageTexture(5, accumulation, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glDispatchCompute(
+        (render_width + work_group.x - 1) / work_group.x,
+        (render_height + work_group.y - 1) / work_group.y,
+        1);
+
+    uniform_ring->fence();
+}
+
+void Renderer::autotune(Vec3 position, Vec3 look_dir)
+{
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    if (width == 0 || height == 0)
+        return;
+
+    if (width != frame_width || height != frame_height)
+        resize_frame(width, height);
+
+    render_width = width;
+    render_height = height;
+    history_valid = false;
+    set_camera(position, look_dir);
+
+    GLuint query;
+    glCreateQueries(GL_TIME_ELAPSED, 1, &query);
+
+    float best_ms = INFINITY;
+    for (auto shape : WORK_GROUP_SHAPES) {
+        GLuint program = build_raytrace_program(shape, RaytracePass::Main);
+
+        for (int i = 0; i < AUTOTUNE_WARMUP_DISPATCHES; i++)
+            dispatch_raytrace(program, shape);
+
+        std::vector<float> samples;
+        for (int i = 0; i < AUTOTUNE_TIMED_DISPATCHES; i++) {
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            dispatch_raytrace(program, shape);
+            glEndQuery(GL_TIME_ELAPSED);
+
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+            samples.push_back(static_cast<float>(nanoseconds) / 1e6f);
+        }
+
+        std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+        float median_ms = samples[samples.size() / 2];
+
+        std::cout << "autotune: " << shape.x << "x" << shape.y << (shape.swizzle ? " swizzled" : "")
+                  << ": " << median_ms << " ms" << std::endl;
+
+        if (median_ms < best_ms) {
+            best_ms = median_ms;
+            work_group = shape;
+        }
+
+        glDeleteProgram(program);
+    }
+
+    glDeleteQueries(1, &query);
+
+    std::cout << "autotune: using " << work_group.x << "x" << work_group.y
+              << (work_group.swizzle ? " swizzled" : "") << std::endl;
+
+    rebuild_programs();
+    tuned_work_group = true;
+    save_work_group_shape(work_group);
+}
+
+void Renderer::resize_frame(int width, int height)
+{
+    glDeleteTextures(2, frames);
+    glDeleteTextures(2, depths);
+    for (int i = 0; i < 2; i++) {
+        frames[i] = create_texture(width, height, GL_RGBA32F, GL_RGBA);
+        depths[i] = create_texture(width, height, GL_RG32F, GL_RG);
+    }
+
+    glDeleteTextures(1, &beam);
+    beam = create_texture(
+        (width + BEAM_TILE_SIZE - 1) / BEAM_TILE_SIZE,
+        (height + BEAM_TILE_SIZE - 1) / BEAM_TILE_SIZE,
+        GL_R32F, GL_RED);
+
+    glDeleteTextures(1, &accumulation);
+    accumulation = create_texture(width, height, GL_RGBA32F, GL_RGBA);
+
+    frame_width = width;
+    frame_height = height;
+    history_valid = false;
+    sample_count = 0;
+}
+
 void Renderer::render()
 {
     int width, height;
     glfwGetFramebufferSize(window, &width, &height);
 
-    glUseProgram(raytrace_program);
-    glDispatchCompute(1280 / 16, 720 / 16, 1);
+    // Minimized
+    if (width == 0 || height == 0) {
+        glfwSwapBuffers(window);
+        return;
+    }
 
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    if (width != frame_width || height != frame_height)
+        resize_frame(width, height);
+
+    bool still = camera_position == last_position && camera_look_dir == last_look_dir;
+    last_position = camera_position;
+    last_look_dir = camera_look_dir;
+    if (!still)
+        sample_count = 0;
+
+    // Captured sequences keep the window resolution throughout
+    bool scaling = dynamic_scale && !capturing;
+
+    float frame_ms;
+    if (trace_timer->poll(frame_ms) && scaling)
+        scale_controller.update(frame_ms);
+
+    float scale = scaling ? scale_controller.get_scale() : 1.0f;
+    int scaled_width = std::max(1, static_cast<int>(static_cast<float>(width) * scale));
+    int scaled_height = std::max(1, static_cast<int>(static_cast<float>(height) * scale));
+
+    // Samples are accumulated at the full resolution, the first one replaces
+    // the regular frame
+    bool accumulating = accumulate && still && debug_view == DebugView::None;
+    if (accumulating) {
+        scaled_width = width;
+        scaled_height = height;
+    }
+
+    // Reprojection assumes the history was traced at the same resolution
+    if (scaled_width != render_width || scaled_height != render_height)
+        history_valid = false;
+
+    render_width = scaled_width;
+    render_height = scaled_height;
+
+    if (debug_view != DebugView::None)
+        glClearNamedBufferData(stats_buffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+    if (streamer)
+        streamer->update();
+
+    if (accumulating) {
+        // Converged, keep showing the result
+        if (sample_count < ACCUMULATE_MAX_SAMPLES) {
+            dispatch_accumulate();
+            sample_count++;
+            history = 1 - history;
+        }
+
+        // The average has no per-pixel distances to reproject with
+        history_valid = false;
+    } else {
+        trace_timer->begin();
+
+        dispatch_raytrace(raytrace_program, work_group);
+
+        trace_timer->end();
+
+        history = 1 - history;
+        history_position = camera_position;
+        history_look_dir = camera_look_dir;
+        history_valid = true;
+    }
+
+    if (streamer)
+        streamer->read_feedback(frame_index);
+
+    frame_index++;
+
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
 
     glViewport(0, 0, width, height);
     glClearColor(0.0, 0.0, 0.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT);
 
     glUseProgram(fullscreen_program);
+    glUniform2i(0, render_width, render_height);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, frame);
+    glBindTexture(GL_TEXTURE_2D, frames[history]);
     glBindVertexArray(vao);
     glDrawArrays(GL_TRIANGLES, 0, 3);
 
+    if (capture) {
+        capture->update();
+        if (capturing)
+            capture->capture(frames[history], render_width, render_height);
+    }
+
     glfwSwapBuffers(window);
 }
 
-void Renderer::set_uniform(GLint location, Vec3 value)
+void Renderer::set_debug_view(DebugView view)
+{
+    if (view == debug_view)
+        return;
+
+    debug_view = view;
+    rebuild_programs();
+}
+
+void Renderer::set_lod_pixel_size(float pixel_size)
+{
+    if (pixel_size == lod_pixel_size)
+        return;
+
+    lod_pixel_size = pixel_size;
+    rebuild_programs();
+}
+
+void Renderer::set_ambient_occlusion(const AmbientOcclusion& ao)
+{
+    if (ao.level_count != level_count || ao.keys.empty())
+        panic("ambient occlusion doesn't match the DAG");
+
+    glDeleteBuffers(2, ao_buffers);
+    ao_buffers[0] = create_storage_buffer(ao.keys, 4);
+    ao_buffers[1] = create_storage_buffer(ao.faces, 5);
+
+    rebuild_programs();
+}
+
+void Renderer::set_shadows(bool enabled)
+{
+    if (enabled == shadows)
+        return;
+
+    shadows = enabled;
+    rebuild_programs();
+}
+
+void Renderer::set_accumulation(bool enabled)
+{
+    accumulate = enabled;
+    if (!enabled)
+        sample_count = 0;
+}
+
+void Renderer::set_capture(const std::string& prefix)
+{
+    capturing = !prefix.empty();
+    if (capturing && (!capture || capture->get_prefix() != prefix))
+        capture = std::make_unique<FrameCapture>(prefix);
+}
+
+bool Renderer::read_traversal_stats(TraversalStats& stats) const
+{
+    if (debug_view == DebugView::None)
+        return false;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glGetNamedBufferSubData(stats_buffer, 0, sizeof(TraversalStats), &stats);
+    return true;
+}
+
+void Renderer::set_camera(Vec3 position, Vec3 look_dir)
 {
-    glUseProgram(raytrace_program);
-    glUniform3fv(location, 1, value.ptr());
+    camera_position = position;
+    camera_look_dir = look_dir;
+}
+
+void Renderer::read_frame(std::vector<float>& output, int& width, int& height) const
+{
+    width = render_width;
+    height = render_height;
+
+    output.resize(static_cast<size_t>(width) * height * 4);
+    glGetTextureSubImage(frames[history], 0, 0, 0, 0, width, height, 1, GL_RGBA, GL_FLOAT,
+        static_cast<GLsizei>(output.size() * sizeof(float)), output.data());
 }
 
 float degrees_to_radians(float value)
@@ -273,24 +1779,53 @@ void on_cursor_move(GLFWwindow* window, double x, double y)
     }
 }
 
+void on_key(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS)
+        return;
+
+    // F1 cycles through the shaded image and the traversal heatmaps
+    if (key == GLFW_KEY_F1) {
+        int next = (static_cast<int>(g_state.debug_view) + 1) % (static_cast<int>(DebugView::Nodes) + 1);
+        g_state.debug_view = static_cast<DebugView>(next);
+    }
+
+    // F2 toggles progressive accumulation while the camera is still
+    if (key == GLFW_KEY_F2)
+        g_state.accumulate = !g_state.accumulate;
+
+    // F3 starts and stops writing frames to disk
+    if (key == GLFW_KEY_F3)
+        g_state.capture = !g_state.capture;
+}
+
 void init_state(Renderer& renderer)
 {
     glfwSetInputMode(renderer.get_window(), GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glfwSetInputMode(renderer.get_window(), GLFW_RAW_MOUSE_MOTION, GLFW_TRUE);
     glfwSetCursorPosCallback(renderer.get_window(), on_cursor_move);
-    g_state.position = {-5, -5, -5};
+    glfwSetKeyCallback(renderer.get_window(), on_key);
+    float offset = -0.5f * static_cast<float>(1 << renderer.get_level_count());
+    g_state.position = {offset, offset, offset};
     g_state.pitch = 45;
     g_state.yaw = 45;
 
     glfwGetCursorPos(renderer.get_window(), &g_state.cursor_x, &g_state.cursor_y);
 }
 
+Vec3 get_look_dir()
+{
+    return normalize(Vec3::from_euler_angles(
+        degrees_to_radians(g_state.pitch),
+        degrees_to_radians(g_state.yaw)));
+}
+
 void main_loop(Renderer& renderer)
 {
+    double last_stats_time = glfwGetTime();
+
     while (!glfwWindowShouldClose(renderer.get_window()) && !glfwGetKey(renderer.get_window(), GLFW_KEY_ESCAPE)) {
-        auto look_dir = normalize(Vec3::from_euler_angles(
-            degrees_to_radians(g_state.pitch),
-            degrees_to_radians(g_state.yaw)));
+        auto look_dir = get_look_dir();
 
         auto right = normalize(cross(look_dir, UP));
 
@@ -317,26 +1852,143 @@ void main_loop(Renderer& renderer)
 
         g_state.position += movement * MOVE_SPEED;
 
-        renderer.set_uniform(1, g_state.position);
-        renderer.set_uniform(2, look_dir);
+        renderer.set_camera(g_state.position, look_dir);
+        renderer.set_debug_view(g_state.debug_view);
+        renderer.set_accumulation(g_state.accumulate);
+        renderer.set_capture(g_state.capture ? g_state.capture_prefix : "");
 
         glfwPollEvents();
         renderer.render();
+
+        TraversalStats stats;
+        double now = glfwGetTime();
+        if (now - last_stats_time >= 1.0 && renderer.read_traversal_stats(stats)) {
+            last_stats_time = now;
+            double rays = std::max(stats.rays, 1u);
+            std::cout << "rays: " << stats.rays
+                      << ", steps/ray: " << stats.steps / rays
+                      << ", nodes/ray: " << stats.nodes_visited / rays << std::endl;
+        }
+    }
+}
+
+// Renders one frame from the initial camera and compares it against the CPU
+// port of the traversal. Meant to be run under a software GL driver, where the
+// results are expected to match exactly. When streaming, frames are rendered
+// until every page the view needs has arrived.
+int validate(Renderer& renderer, const std::vector<uint32_t>& nodes, const AmbientOcclusion* ao)
+{
+    auto look_dir = get_look_dir();
+    renderer.set_dynamic_scale(false);
+    renderer.set_reprojection(false);
+    renderer.set_camera(g_state.position, look_dir);
+
+    int frames = 0;
+    do {
+        renderer.render();
+        frames++;
+    } while (!renderer.is_fully_streamed() && frames < VALIDATE_MAX_FRAMES);
+
+    if (frames > 1)
+        std::cout << "validate: streamed in " << frames << " frames" << std::endl;
+
+    int width, height;
+    std::vector<float> gpu_frame;
+    renderer.read_frame(gpu_frame, width, height);
+
+    std::vector<float> cpu_frame;
+    render_reference(nodes, renderer.get_level_count(), g_state.position, look_dir, width, height, cpu_frame,
+        DebugView::None, renderer.get_lod_pixel_size(), ao, renderer.has_shadows());
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < cpu_frame.size(); i += 4) {
+        if (!std::equal(&cpu_frame[i], &cpu_frame[i] + 4, &gpu_frame[i]))
+            mismatches++;
     }
+
+    std::cout << "validate: " << mismatches << " of " << cpu_frame.size() / 4 << " pixels differ" << std::endl;
+
+    return mismatches == 0 ? 0 : 1;
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    bool validate_only = false;
+    bool force_autotune = false;
+    std::string stream_path;
+    std::string ao_path;
+    uint32_t pool_pages = STREAM_POOL_PAGES;
+    float lod_pixel_size = LOD_PIXEL_SIZE;
+    bool shadows = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--validate")
+            validate_only = true;
+        else if (arg == "--autotune")
+            force_autotune = true;
+        else if (arg == "--stream" && i + 1 < argc)
+            stream_path = argv[++i];
+        else if (arg == "--pool-pages" && i + 1 < argc)
+            pool_pages = static_cast<uint32_t>(std::stoul(argv[++i]));
+        else if (arg == "--capture" && i + 1 < argc) {
+            g_state.capture = true;
+            g_state.capture_prefix = argv[++i];
+        } else if (arg == "--accumulate")
+            g_state.accumulate = true;
+        else if (arg == "--no-shadows")
+            shadows = false;
+        else if (arg == "--ao" && i + 1 < argc)
+            ao_path = argv[++i];
+        else if (arg == "--lod" && i + 1 < argc)
+            lod_pixel_size = std::stof(argv[++i]);
+        else
+            panic("unknown argument: ", arg);
+    }
+
     if (!glfwInit()) {
         panic("failed to initialize GLFW");
     }
 
+    int result = 0;
+
     {
-        Renderer renderer;
-        init_state(renderer);
-        main_loop(renderer);
+        std::unique_ptr<Renderer> renderer;
+        std::vector<uint32_t> nodes;
+
+        if (stream_path.empty()) {
+            Map map;
+            DAG dag(map, LEVEL_COUNT);
+            renderer = std::make_unique<Renderer>(dag);
+            nodes = dag.flatten();
+        } else {
+            renderer = std::make_unique<Renderer>(stream_path, pool_pages);
+            if (validate_only) {
+                DAGFile file(stream_path);
+                file.read_all(nodes);
+            }
+        }
+
+        renderer->set_lod_pixel_size(lod_pixel_size);
+        renderer->set_shadows(shadows);
+
+        AmbientOcclusion ao;
+        if (!ao_path.empty()) {
+            if (!ao.read(ao_path))
+                panic("failed to read ambient occlusion: ", ao_path);
+            renderer->set_ambient_occlusion(ao);
+        }
+
+        init_state(*renderer);
+
+        if (force_autotune || (!validate_only && !renderer->has_tuned_work_group()))
+            renderer->autotune(g_state.position, get_look_dir());
+
+        if (validate_only)
+            result = validate(*renderer, nodes, ao_path.empty() ? nullptr : &ao);
+        else
+            main_loop(*renderer);
     }
 
     glfwTerminate();
-    return 0;
+    return result;
 }